@@ -0,0 +1,48 @@
+/*
+    Car controls.
+    Copyright (C) 2015-16 Igor Stoppa <igor.stoppa@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef MOTORS_WIRING_H
+#define MOTORS_WIRING_H
+
+#include "motorpins.h"
+
+/*
+  Motors wiring, specific to the ATMega328P board.
+
+  TC0 drives the right side, TC2 the left side:
+  0A PD6 (Arduino Pin  6) = PWM RIGHT FRONT MOTOR
+  0B PD5 (Arduino Pin  5) = PWM RIGHT REAR  MOTOR
+  2A PB3 (Arduino Pin 11) = PWM LEFT  FRONT MOTOR
+  2B PD3 (Arduino Pin  3) = PWM LEFT  REAR  MOTOR
+
+  Parameters: timer, channel, PWM port and pin,
+              direction port, forward pin, backward pin.
+*/
+
+template<> struct Wiring<RIGHT_FRONT> :
+  MotorWiring<PWM_TIMER0, PWM_CHANNEL_A, GPIO_PORTD, 6, GPIO_PORTB, 0, 1> {};
+
+template<> struct Wiring<RIGHT_REAR> :
+  MotorWiring<PWM_TIMER0, PWM_CHANNEL_B, GPIO_PORTD, 5, GPIO_PORTD, 7, 4> {};
+
+template<> struct Wiring<LEFT_FRONT> :
+  MotorWiring<PWM_TIMER2, PWM_CHANNEL_A, GPIO_PORTB, 3, GPIO_PORTB, 4, 2> {};
+
+template<> struct Wiring<LEFT_REAR> :
+  MotorWiring<PWM_TIMER2, PWM_CHANNEL_B, GPIO_PORTD, 3, GPIO_PORTD, 0, 1> {};
+
+#endif
@@ -0,0 +1,34 @@
+/*
+    Car controls.
+    Copyright (C) 2015-16 Igor Stoppa <igor.stoppa@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef VEHICLE_H
+#define VEHICLE_H
+
+#include "motors.h"
+
+/*
+  Geometry of the vehicle, for the velocity commands.
+  The tacho counts both edges of the encoder signal.
+*/
+
+#define WHEEL_RADIUS_MM 33
+#define WHEEL_BASE_MM 140
+#define TACHO_EDGES_PER_REVOLUTION 40
+
+#define VEHICLE_LEFT_MOTORS (_BV(LEFT_REAR) | _BV(LEFT_FRONT))
+
+#endif
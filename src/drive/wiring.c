@@ -35,12 +35,9 @@
   PC2 (Arduino Pin 16) = RIGHT REAR  MOTOR
   PC3 (Arduino Pin 17) = RIGHT FRONT MOTOR
 
-  Motors are connected to TC0 and to TC2.
+  Motors are connected to TC0 and to TC2, as described in
+  motorswiring.h, together with their direction pins.
   TC1 is reserved by the OS for tickless functionality.
-  2A (Arduino Pin  6) = PWM LEFT  FRONT MOTOR
-  2B (Arduino Pin  5) = PWM RIGHT FRONT MOTOR
-  0A (Arduino Pin 11) = PWM LEFT  REAR  MOTOR
-  0B (Arduino Pin  3) = PWM RIGHT REAR  MOTOR
 
   Of the remaining pins, pairs from the same port are used
   to control the spinning directon of each motor:
@@ -81,56 +78,5 @@ Motors motorslinkage[MOTORS_NUMBER] = {
   [RIGHT_REAR] = RIGHT_FRONT,
 };
 
-MotorData motorsdata[MOTORS_NUMBER] = {
-  [RIGHT_FRONT] = {
-    .pwm_ddr_address = &DDRD,
-    .pwm_pin_bit_mask = _BV(6),
-    .pwm_counter_address = &OCR0A,
-    .pwm_control_register_address = &TCCR0A,
-    .pwm_compare_output_mode_mask = _BV(COM0A1),
-    .pwm_wgm_cs_mask = (3 << 4) | 3,
-    .dir_ddr_address = &DDRB,
-    .dir_pin_address = &PORTB,
-    .dir_forward_bit_mask = _BV(0),
-    .dir_backward_bit_mask = _BV(1),
-  },
-  [RIGHT_REAR] = {
-    .pwm_ddr_address = &DDRD,
-    .pwm_pin_bit_mask = _BV(3),
-    .pwm_counter_address = &OCR0B,
-    .pwm_control_register_address = &TCCR2A,
-    .pwm_compare_output_mode_mask = _BV(COM2A1),
-    .pwm_wgm_cs_mask = (3 << 4) | 4,
-    .dir_ddr_address = &DDRD,
-    .dir_pin_address = &PORTD,
-    .dir_forward_bit_mask = _BV(7),
-    .dir_backward_bit_mask = _BV(4),
-  },
-  [LEFT_FRONT] = {
-    .pwm_ddr_address = &DDRB,
-    .pwm_pin_bit_mask = _BV(3),
-    .pwm_counter_address = &OCR2A,
-    .pwm_control_register_address = &TCCR0A,
-    .pwm_compare_output_mode_mask = _BV(COM0B1),
-    .pwm_wgm_cs_mask = (3 << 4) | 3,
-    .dir_ddr_address = &DDRB,
-    .dir_pin_address = &PORTB,
-    .dir_forward_bit_mask = _BV(4),
-    .dir_backward_bit_mask = _BV(2),
-  },
-  [LEFT_REAR] = {
-    .pwm_ddr_address = &DDRD,
-    .pwm_pin_bit_mask = _BV(5),
-    .pwm_counter_address = &OCR2B,
-    .pwm_control_register_address = &TCCR2A,
-    .pwm_compare_output_mode_mask = _BV(COM2B1),
-    .pwm_wgm_cs_mask = (3 << 4) | 4,
-    .dir_ddr_address = &DDRD,
-    .dir_pin_address = &PORTD,
-    .dir_forward_bit_mask = _BV(0),
-    .dir_backward_bit_mask = _BV(1),
-  },
-};
-
 
 DECLARE_TWI_HANDLERS(motor);
@@ -18,9 +18,11 @@
 #ifndef ITERATORS_H
 #define ITERATORS_H
 
-#define VA_NARGS_IMPL(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, N, ...) N
+#define VA_NARGS_IMPL(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, \
+                      _11, _12, _13, _14, _15, _16, N, ...) N
 #define VA_NARGS(...) \
-  VA_NARGS_IMPL(__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+  VA_NARGS_IMPL(__VA_ARGS__, 16, 15, 14, 13, 12, 11, \
+                10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
 
 #define merge(a, b) a##b
 #define dereference_and_merge(a, b) merge(a, b)
@@ -70,6 +72,26 @@
   prefix##parameter, \
   ITERATE_PREPEND_10(prefix,  __VA_ARGS__)
 
+#define ITERATE_PREPEND_12(prefix, parameter, ...) \
+  prefix##parameter, \
+  ITERATE_PREPEND_11(prefix,  __VA_ARGS__)
+
+#define ITERATE_PREPEND_13(prefix, parameter, ...) \
+  prefix##parameter, \
+  ITERATE_PREPEND_12(prefix,  __VA_ARGS__)
+
+#define ITERATE_PREPEND_14(prefix, parameter, ...) \
+  prefix##parameter, \
+  ITERATE_PREPEND_13(prefix,  __VA_ARGS__)
+
+#define ITERATE_PREPEND_15(prefix, parameter, ...) \
+  prefix##parameter, \
+  ITERATE_PREPEND_14(prefix,  __VA_ARGS__)
+
+#define ITERATE_PREPEND_16(prefix, parameter, ...) \
+  prefix##parameter, \
+  ITERATE_PREPEND_15(prefix,  __VA_ARGS__)
+
 #define ITERATE_PREPEND(prefix, ...) \
   dereference_and_merge(iterate_prepend_macro_prefix, \
                         VA_NARGS(__VA_ARGS__))(prefix, __VA_ARGS__)
@@ -120,6 +142,26 @@
   action(parameter),                      \
   ITERATE_COMMA_10(action,  __VA_ARGS__)
 
+#define ITERATE_COMMA_12(action, parameter, ...) \
+  action(parameter),                      \
+  ITERATE_COMMA_11(action,  __VA_ARGS__)
+
+#define ITERATE_COMMA_13(action, parameter, ...) \
+  action(parameter),                      \
+  ITERATE_COMMA_12(action,  __VA_ARGS__)
+
+#define ITERATE_COMMA_14(action, parameter, ...) \
+  action(parameter),                      \
+  ITERATE_COMMA_13(action,  __VA_ARGS__)
+
+#define ITERATE_COMMA_15(action, parameter, ...) \
+  action(parameter),                      \
+  ITERATE_COMMA_14(action,  __VA_ARGS__)
+
+#define ITERATE_COMMA_16(action, parameter, ...) \
+  action(parameter),                      \
+  ITERATE_COMMA_15(action,  __VA_ARGS__)
+
 #define ITERATE_COMMA(action, ...) \
   dereference_and_merge(iterate_comma_macro_prefix, \
                         VA_NARGS(__VA_ARGS__))(action, __VA_ARGS__)
@@ -169,6 +211,26 @@
   action(parameter);                      \
   ITERATE_SEMICOLON_10(action,  __VA_ARGS__)
 
+#define ITERATE_SEMICOLON_12(action, parameter, ...) \
+  action(parameter);                      \
+  ITERATE_SEMICOLON_11(action,  __VA_ARGS__)
+
+#define ITERATE_SEMICOLON_13(action, parameter, ...) \
+  action(parameter);                      \
+  ITERATE_SEMICOLON_12(action,  __VA_ARGS__)
+
+#define ITERATE_SEMICOLON_14(action, parameter, ...) \
+  action(parameter);                      \
+  ITERATE_SEMICOLON_13(action,  __VA_ARGS__)
+
+#define ITERATE_SEMICOLON_15(action, parameter, ...) \
+  action(parameter);                      \
+  ITERATE_SEMICOLON_14(action,  __VA_ARGS__)
+
+#define ITERATE_SEMICOLON_16(action, parameter, ...) \
+  action(parameter);                      \
+  ITERATE_SEMICOLON_15(action,  __VA_ARGS__)
+
 #define ITERATE_SEMICOLON(action, ...) \
   dereference_and_merge(iterate_semicolon_macro_prefix, \
                         VA_NARGS(__VA_ARGS__))(action, __VA_ARGS__)
@@ -0,0 +1,53 @@
+/*
+    Car controls.
+    Copyright (C) 2015-16 Igor Stoppa <igor.stoppa@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <stddef.h>
+#include <util/crc16.h>
+#include "ch.h"
+#include "hal.h"
+#include "calibrationstore.h"
+
+CalibrationRecord EEMEM calibration_record;
+
+// CRC16 of everything but the checksum itself, read from the EEPROM.
+static uint16_t
+checksum(void) {
+  const uint8_t *data = (const uint8_t *)&calibration_record;
+  uint16_t crc = 0xFFFF;
+  for (uint16_t i = 0; i < offsetof(CalibrationRecord, checksum); i++)
+    crc = _crc16_update(crc, eeprom_read_byte(data + i));
+  return crc;
+}
+
+bool
+calibrationValid(void) {
+  return (eeprom_read_byte(&calibration_record.version) ==
+          CALIBRATION_STORE_VERSION) &&
+         (eeprom_read_word(&calibration_record.checksum) == checksum());
+}
+
+// To be called once all the fields have been written.
+void
+calibrationSeal(void) {
+  eeprom_update_byte(&calibration_record.version, CALIBRATION_STORE_VERSION);
+  eeprom_update_word(&calibration_record.checksum, checksum());
+}
+
+void
+calibrationInvalidate(void) {
+  eeprom_update_byte(&calibration_record.version, 0xFF);
+}
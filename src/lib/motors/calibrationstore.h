@@ -0,0 +1,61 @@
+/*
+    Car controls.
+    Copyright (C) 2015-16 Igor Stoppa <igor.stoppa@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef CALIBRATION_STORE_H
+#define CALIBRATION_STORE_H
+
+#include <avr/eeprom.h>
+#include "motorcontrol.h"
+
+/*
+  Calibration of the motors, persisted in the internal EEPROM.
+  The record is accepted only if both its version and its checksum
+  match, so a change of layout or a partial write forces a new
+  calibration. EEPROM writes take ~3.3ms per byte, which makes saving
+  unsuitable for ISR context.
+  The record is accessed field by field, in place: the checksum is
+  computed over the content of the EEPROM.
+*/
+
+#define CALIBRATION_STORE_VERSION 3
+
+typedef struct {
+  packed_period_t min_period;
+  packed_period_t static_max_period;
+  packed_period_t dynamic_max_period;
+  uint8_t static_min_pwm;
+  uint8_t dynamic_min_pwm;
+  fixed_t m;
+  fixed_t q;
+  uint8_t table_pwms[PWM_TABLE_POINTS];
+  packed_period_t table_periods[PWM_TABLE_POINTS];
+} __attribute__((__packed__)) MotorCalibrationData;
+
+typedef struct {
+  uint8_t version;
+  uint8_t pwm_table_mask;
+  MotorCalibrationData motors[MOTORS_NUMBER][DIRECTIONS];
+  uint16_t checksum;
+} __attribute__((__packed__)) CalibrationRecord;
+
+extern CalibrationRecord EEMEM calibration_record;
+
+bool calibrationValid(void);
+void calibrationSeal(void);
+void calibrationInvalidate(void);
+
+#endif
@@ -0,0 +1,48 @@
+/*
+    Car controls.
+    Copyright (C) 2015-16 Igor Stoppa <igor.stoppa@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <avr/io.h>
+#include "ch.h"
+#include "hal.h"
+#include "hirestime.h"
+
+// Time of the last TC0 overflow, in high resolution ticks.
+volatile hirestime_t hrt_base;
+
+void
+hrtInit(void) {
+  hrt_base = 0;
+  TIMSK0 |= _BV(TOIE0);
+}
+
+hirestime_t
+hrtGetTimeX(void) {
+  hirestime_t base = hrt_base;
+  uint8_t count = TCNT0;
+  // The overflow might be pending, not yet accounted for by the ISR.
+  if ((TIFR0 & _BV(TOV0)) && (count < 0x80))
+    base += 0x100;
+  return base | count;
+}
+
+hirestime_t
+hrtGetTime(void) {
+  chSysLock();
+  hirestime_t time = hrtGetTimeX();
+  chSysUnlock();
+  return time;
+}
@@ -0,0 +1,69 @@
+/*
+    Car controls.
+    Copyright (C) 2015-16 Igor Stoppa <igor.stoppa@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef HIRES_TIME_H
+#define HIRES_TIME_H
+
+#include "ch.h"
+#include "hal.h"
+#include "motorpins.h"
+
+/*
+  High resolution timebase, for timestamping tacho events.
+
+  TC1 is reserved by the OS and runs at clk/1024, which is the 64us
+  resolution of systime_t. TC0 is free running at clk/PWM_PRESCALER,
+  for the PWM, so its counter, extended in software with the overflows,
+  provides a 32 bits timestamp (4us resolution, wrapping every ~4.7
+  hours, with the default clk/64).
+  Since both timers share the same prescaler, one system tick is
+  exactly 2^HRT_ST_SHIFT high resolution ticks.
+*/
+
+typedef uint32_t hirestime_t;
+
+#define HRT_PRESCALER PWM_PRESCALER
+#define HRT_FREQUENCY (F_CPU / HRT_PRESCALER)
+
+#if HRT_PRESCALER == 64
+#define HRT_ST_SHIFT 4
+#elif HRT_PRESCALER == 256
+#define HRT_ST_SHIFT 2
+#else
+#error "Unsupported high resolution timer prescaler."
+#endif
+
+#define HT2ST(ht) ((systime_t)((ht) >> HRT_ST_SHIFT))
+#define ST2HT(st) (((hirestime_t)(st)) << HRT_ST_SHIFT)
+#define US2HT(us) \
+  ((hirestime_t)(((uint64_t)(us) * HRT_FREQUENCY) / 1000000UL))
+
+extern volatile hirestime_t hrt_base;
+
+void hrtInit(void);
+
+// To be called by the TC0 overflow ISR, owned by the motors driver.
+static inline void hrtOverflowI(void) {
+  hrt_base += 0x100;
+}
+
+// To be called with interrupts disabled (ISR or locked context).
+hirestime_t hrtGetTimeX(void);
+
+hirestime_t hrtGetTime(void);
+
+#endif
@@ -15,10 +15,15 @@
     limitations under the License.
 */
 
+#include <avr/io.h>
+#include <avr/interrupt.h>
 #include "ch.h"
 #include "hal.h"
 #include "motorcontrol.h"
+#include "motorswiring.h"
+#include "vehicle.h"
 #include "tachomotor.h"
+#include "calibrationstore.h"
 
 template<int s> struct Sizer;
 struct foo {
@@ -32,9 +37,19 @@ typedef enum {
   MAX_PWM = 255,
 } Limits;
 
-extern MotorData motorsdata[MOTORS_NUMBER];
 extern Motors motorslinkage[MOTORS_NUMBER];
 
+// Two motors driven by the same timer channel would fight over it.
+static_assert((_BV(Wiring<LEFT_REAR>::output_id) |
+               _BV(Wiring<RIGHT_REAR>::output_id) |
+               _BV(Wiring<RIGHT_FRONT>::output_id) |
+               _BV(Wiring<LEFT_FRONT>::output_id)) ==
+              (_BV(Wiring<LEFT_REAR>::output_id) +
+               _BV(Wiring<RIGHT_REAR>::output_id) +
+               _BV(Wiring<RIGHT_FRONT>::output_id) +
+               _BV(Wiring<LEFT_FRONT>::output_id)),
+              "Each motor needs its own PWM output.");
+
 uint8_t
 twi_motor_handler(uint8_t mode);
 
@@ -47,26 +62,36 @@ MotorsDriver::MotorsDriver(void) {
     setPWM(i, 0x00);
     idle(i);
   }
+  setPhase(PWM_PHASE_INTERLEAVED);
 }
 
+volatile uint8_t MotorsDriver::pwm_phase = PWM_PHASE_ALIGNED;
+
+// The prescalers of all the timers are held in reset while TC2 is
+// aligned to TC0, then released together, so the two PWMs stay locked.
+// TC0 is not written, to preserve the high resolution timebase, while
+// TC1, the OS tick, can lose at most the count of its prescaler.
 void
-MotorsDriver::configure(uint8_t motor) {
-  register MotorData &m = motorsdata[motor];
-  // Set PWM pin as output.
-  (*m.pwm_ddr_address) |= m.pwm_pin_bit_mask;
-  // Set PWM mode and divider.
-  (*m.pwm_control_register_address) |=
-    m.pwm_compare_output_mode_mask | ((m.pwm_wgm_cs_mask >> 4) & 3);
-  (*(m.pwm_control_register_address + 1)) |=
-    ((m.pwm_wgm_cs_mask >> 3) & 8) | (m.pwm_wgm_cs_mask & 7);
-  // Set Forward/Backward pins as output.
-  (*m.dir_ddr_address) |= (m.dir_forward_bit_mask | m.dir_backward_bit_mask);
+MotorsDriver::setPhase(uint8_t phase) {
+  if (phase >= PWM_PHASES)
+    return;
+  syssts_t sts = chSysGetStatusAndLockX();
+  GTCCR = _BV(TSM) | _BV(PSRASY) | _BV(PSRSYNC);
+  PWMTimerRegs<PWM_TIMER2>::tcnt() = PWMTimerRegs<PWM_TIMER0>::tcnt() +
+    ((phase == PWM_PHASE_INTERLEAVED) ? 0x80 : 0);
+  GTCCR = 0;
+  pwm_phase = phase;
+  chSysRestoreStatusX(sts);
 }
 
 void
-MotorsDriver::setPWM(uint8_t motor, uint8_t val) {
-  uint8_t start_motor;
-  uint8_t end_motor;
+MotorsDriver::configure(uint8_t motor) {
+  wiring_call(motor, configure());
+}
+
+// Translates the motor, possibly ALL_MOTORS, to a range of motors.
+static void
+motors_range(uint8_t motor, uint8_t &start_motor, uint8_t &end_motor) {
   if (motor < ALL_MOTORS) {
     start_motor = motor;
     end_motor = motor + 1;
@@ -76,82 +101,284 @@ MotorsDriver::setPWM(uint8_t motor, uint8_t val) {
   } else {
     start_motor = end_motor = 0;
   }
+}
+
+// Any ramp or dithering in progress on the motor is cancelled.
+void
+MotorsDriver::setPWM(uint8_t motor, uint8_t val) {
+  uint8_t start_motor;
+  uint8_t end_motor;
+  motors_range(motor, start_motor, end_motor);
   for (uint8_t counter = start_motor; counter < end_motor; counter++) {
+    syssts_t sts = chSysGetStatusAndLockX();
+    ramp_mask &= ~_BV(counter);
+    hires_mask &= ~_BV(counter);
+    ramp_targets[counter] = val;
     // PWM duty cycle, expressed in 255ths of the PWM period.
-    (*motorsdata[counter].pwm_counter_address) = val;
+    wiring_call(counter, setPWM(val));
+    chSysRestoreStatusX(sts);
   }
 }
 
 uint8_t
 MotorsDriver::getPWM(uint8_t motor) {
   // PWM duty cycle, expressed in 255ths of the PWM period.
-  return (*motorsdata[motor].pwm_counter_address);
+  wiring_return(motor, getPWM(), 0);
 }
 
+// Both direction pins are written at once, so that a reversal does not
+// go through LOCK or IDLE.
 void
-MotorsDriver::increasePWM(uint8_t motor, uint8_t delta) {
-  uint8_t pwm = (*motorsdata[motor].pwm_counter_address) + delta;
-  (*motorsdata[motor].pwm_counter_address) = (pwm < delta) ? MAX_PWM : pwm;
+MotorsDriver::setState(uint8_t motor, MotorStates state) {
+  uint8_t start_motor;
+  uint8_t end_motor;
+  if (state >= MOTOR_STATES)
+    return;
+  motors_range(motor, start_motor, end_motor);
+  for (uint8_t counter = start_motor; counter < end_motor; counter++) {
+    syssts_t sts = chSysGetStatusAndLockX();
+    wiring_call(counter, setState(state));
+    chSysRestoreStatusX(sts);
+  }
+}
+
+uint8_t
+MotorsDriver::getState(uint8_t motor) {
+  wiring_return(motor, getState(), IDLE);
 }
 
+MotorsShadow MotorsDriver::staged;
+MotorsShadow MotorsDriver::committing;
+volatile uint8_t MotorsDriver::commit_phase = COMMIT_IDLE;
+
 void
-MotorsDriver::decreasePWM(uint8_t motor, uint8_t delta) {
-  if ((*motorsdata[motor].pwm_counter_address) > delta)
-    (*motorsdata[motor].pwm_counter_address) -= delta;
-  else
-    (*motorsdata[motor].pwm_counter_address) = 0;
+MotorsDriver::stageHiresPWM(uint8_t motor, uint16_t val) {
+  uint8_t start_motor;
+  uint8_t end_motor;
+  motors_range(motor, start_motor, end_motor);
+  syssts_t sts = chSysGetStatusAndLockX();
+  for (uint8_t counter = start_motor; counter < end_motor; counter++) {
+    staged.pwm[counter] = val;
+    staged.pwm_mask |= _BV(counter);
+  }
+  chSysRestoreStatusX(sts);
 }
 
 void
-MotorsDriver::setState(uint8_t motor, MotorStates state) {
+MotorsDriver::stageState(uint8_t motor, MotorStates state) {
   uint8_t start_motor;
   uint8_t end_motor;
-  if (motor < ALL_MOTORS) {
-    start_motor = motor;
-    end_motor = motor + 1;
-  } else if (motor == ALL_MOTORS){
-    start_motor = 0;
-    end_motor = MOTORS_NUMBER;
-  } else {
-    start_motor = end_motor = 0;
+  if (state >= MOTOR_STATES)
+    return;
+  motors_range(motor, start_motor, end_motor);
+  syssts_t sts = chSysGetStatusAndLockX();
+  for (uint8_t counter = start_motor; counter < end_motor; counter++) {
+    staged.state[counter] = state;
+    staged.state_mask |= _BV(counter);
+  }
+  chSysRestoreStatusX(sts);
+}
+
+// Hands the staged values over to the ISR. If a previous commit is
+// still in progress, the new values are merged into it.
+void
+MotorsDriver::commit(void) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    if (staged.pwm_mask & _BV(i))
+      committing.pwm[i] = staged.pwm[i];
+    if (staged.state_mask & _BV(i))
+      committing.state[i] = staged.state[i];
   }
+  committing.pwm_mask |= staged.pwm_mask;
+  committing.state_mask |= staged.state_mask;
+  staged.pwm_mask = staged.state_mask = 0;
+  if (committing.pwm_mask | committing.state_mask) {
+    // A pending TC2 commit restarts along with the merged values.
+    TIMSK2 &= ~_BV(TOIE2);
+    commit_phase = COMMIT_PWM;
+  }
+  chSysRestoreStatusX(sts);
+}
+
+volatile uint8_t MotorsDriver::ramp_mask;
+volatile uint8_t MotorsDriver::ramp_targets[MOTORS_NUMBER];
+volatile uint16_t MotorsDriver::ramp_rates[MOTORS_NUMBER];
+uint8_t MotorsDriver::ramp_fractions[MOTORS_NUMBER];
+volatile uint16_t MotorsDriver::default_ramp_rate = PWM_RAMP_NONE;
+
+// The PWM moves toward the target by the rate at each PWM cycle,
+// driven by the PWM overflow ISR.
+void
+MotorsDriver::rampPWM(uint8_t motor, uint8_t target, uint16_t rate) {
+  uint8_t start_motor;
+  uint8_t end_motor;
+  if (rate == PWM_RAMP_NONE) {
+    setPWM(motor, target);
+    return;
+  }
+  motors_range(motor, start_motor, end_motor);
+  syssts_t sts = chSysGetStatusAndLockX();
   for (uint8_t counter = start_motor; counter < end_motor; counter++) {
-    register MotorData &m = motorsdata[counter];
-    switch (state) {
-      case IDLE:
-        (*m.dir_pin_address) &=
-          ~(m.dir_forward_bit_mask | m.dir_backward_bit_mask);
-        break;
-      case BACKWARD:
-        (*m.dir_pin_address) &= ~m.dir_forward_bit_mask;
-        (*m.dir_pin_address) |= m.dir_backward_bit_mask;
-        break;
-      case FORWARD:
-        (*m.dir_pin_address) |= m.dir_forward_bit_mask;
-        (*m.dir_pin_address) &= ~m.dir_backward_bit_mask;
-        break;
-      case LOCK:
-        (*m.dir_pin_address) |=
-          m.dir_forward_bit_mask | m.dir_backward_bit_mask;
-        break;
-      default: break;
-    }
+    if (!(ramp_mask & _BV(counter)))
+      ramp_fractions[counter] = 0;
+    hires_mask &= ~_BV(counter);
+    ramp_targets[counter] = target;
+    ramp_rates[counter] = rate;
+    ramp_mask |= _BV(counter);
   }
+  chSysRestoreStatusX(sts);
 }
 
-uint8_t
-MotorsDriver::getState(uint8_t motor) {
-  register MotorData &m = motorsdata[motor];
-  uint8_t forward = (*m.dir_pin_address) & m.dir_forward_bit_mask;
-  uint8_t backward = (*m.dir_pin_address) & m.dir_backward_bit_mask;
-  if (forward && backward)
-    return LOCK;
-  else if (forward)
-    return FORWARD;
-  else if (backward)
-    return BACKWARD;
+void
+MotorsDriver::rampCycleI(void) {
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    if (!(ramp_mask & _BV(i)))
+      continue;
+    uint16_t steps = ramp_fractions[i] + ramp_rates[i];
+    uint8_t step = steps >> PWM_RAMP_RATE_SHIFT;
+    ramp_fractions[i] = (uint8_t)steps;
+    uint8_t pwm = motorsdriver->getPWM(i);
+    uint8_t target = ramp_targets[i];
+    if (target > pwm)
+      pwm = ((uint8_t)(target - pwm) > step) ? pwm + step : target;
+    else
+      pwm = ((uint8_t)(pwm - target) > step) ? pwm - step : target;
+    wiring_call(i, setPWM(pwm));
+    if (pwm == target)
+      ramp_mask &= ~_BV(i);
+  }
+}
+
+volatile uint8_t MotorsDriver::hires_mask;
+volatile uint16_t MotorsDriver::hires_pwms[MOTORS_NUMBER];
+uint8_t MotorsDriver::dither_errors[MOTORS_NUMBER];
+
+// Without a fraction, there is nothing to dither.
+void
+MotorsDriver::setHiresPWMI(uint8_t motor, uint16_t val) {
+  ramp_mask &= ~_BV(motor);
+  ramp_targets[motor] = val >> PWM_HIRES_SHIFT;
+  if (val & PWM_HIRES_FRACTION_MASK) {
+    hires_pwms[motor] = val;
+    hires_mask |= _BV(motor);
+  } else {
+    hires_mask &= ~_BV(motor);
+  }
+  wiring_call(motor, setPWM(val >> PWM_HIRES_SHIFT));
+}
+
+void
+MotorsDriver::setHiresPWM(uint8_t motor, uint16_t val) {
+  uint8_t start_motor;
+  uint8_t end_motor;
+  motors_range(motor, start_motor, end_motor);
+  syssts_t sts = chSysGetStatusAndLockX();
+  for (uint8_t counter = start_motor; counter < end_motor; counter++)
+    setHiresPWMI(counter, val);
+  chSysRestoreStatusX(sts);
+}
+
+uint16_t
+MotorsDriver::getHiresPWM(uint8_t motor) {
+  uint16_t val;
+  syssts_t sts = chSysGetStatusAndLockX();
+  if (hires_mask & _BV(motor))
+    val = hires_pwms[motor];
   else
-    return IDLE;
+    val = (uint16_t)getPWM(motor) << PWM_HIRES_SHIFT;
+  chSysRestoreStatusX(sts);
+  return val;
+}
+
+// The fraction accumulates into the error and each carry raises the
+// OCR by one step for a cycle, so that on average the duty cycle has
+// the full resolution.
+void
+MotorsDriver::ditherCycleI(void) {
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    if (!(hires_mask & _BV(i)))
+      continue;
+    uint16_t val = hires_pwms[i];
+    uint16_t error = dither_errors[i] + (val & PWM_HIRES_FRACTION_MASK);
+    uint8_t pwm = val >> PWM_HIRES_SHIFT;
+    dither_errors[i] = (uint8_t)error;
+    if ((error >> PWM_HIRES_SHIFT) && (pwm < MAX_PWM))
+      pwm++;
+    wiring_call(i, setPWM(pwm));
+  }
+}
+
+template<GPIOPort port> static inline void
+commit_port(const uint8_t clear[GPIO_PORTS], const uint8_t set[GPIO_PORTS]) {
+  if (clear[port])
+    GPIO<port>::out() = (GPIO<port>::out() & ~clear[port]) | set[port];
+}
+
+#define timer2_bit(motor) \
+  ((Wiring<motor>::timer == PWM_TIMER2) ? _BV(motor) : 0)
+
+// Motors whose OCR is latched at the TOP of TC2.
+static constexpr uint8_t timer2_motors =
+  timer2_bit(LEFT_REAR) | timer2_bit(RIGHT_REAR) |
+  timer2_bit(RIGHT_FRONT) | timer2_bit(LEFT_FRONT);
+
+// Direction changes grouped by port.
+void
+MotorsDriver::commitStatesI(uint8_t mask) {
+  uint8_t clear[GPIO_PORTS] = {0};
+  uint8_t set[GPIO_PORTS] = {0};
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    if (mask & _BV(i))
+      wiring_call(i, addDirection(committing.state[i], clear, set));
+  commit_port<GPIO_PORTB>(clear, set);
+  commit_port<GPIO_PORTC>(clear, set);
+  commit_port<GPIO_PORTD>(clear, set);
+  committing.state_mask &= ~mask;
+}
+
+// The OCRs written here take effect at the next TOP of their timer, when
+// the directions follow. When interleaved, TC2 reaches TOP half a cycle
+// before TC0, so the directions of its motors are committed by its own
+// overflow, enabled just for that.
+void
+MotorsDriver::pwmCycleI(void) {
+  switch (commit_phase) {
+    case COMMIT_PWM: {
+      for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+        if (committing.pwm_mask & _BV(i))
+          setHiresPWMI(i, committing.pwm[i]);
+      committing.pwm_mask = 0;
+      if ((pwm_phase == PWM_PHASE_INTERLEAVED) &&
+          (committing.state_mask & timer2_motors)) {
+        TIFR2 = _BV(TOV2);
+        TIMSK2 |= _BV(TOIE2);
+      }
+      commit_phase = COMMIT_STATE;
+    } break;
+    case COMMIT_STATE: {
+      commitStatesI(committing.state_mask);
+      commit_phase = COMMIT_IDLE;
+    } break;
+  }
+}
+
+void
+MotorsDriver::timer2CycleI(void) {
+  commitStatesI(committing.state_mask & timer2_motors);
+  TIMSK2 &= ~_BV(TOIE2);
+}
+
+// TC0 drives half of the motors and its overflow marks the PWM cycle.
+ISR(TIMER0_OVF_vect) {
+  hrtOverflowI();
+  MotorsDriver::rampCycleI();
+  MotorsDriver::pwmCycleI();
+  MotorsDriver::ditherCycleI();
+}
+
+ISR(TIMER2_OVF_vect) {
+  MotorsDriver::timer2CycleI();
 }
 
 #define WRITE_VALUE 0x0
@@ -161,171 +388,787 @@ MotorsDriver::getState(uint8_t motor) {
 
 DECLARE_EXTERN_TWI_HANDLERS(motor);
 
-static THD_WORKING_AREA(waThreadMotor, 32);
+// The drive mode handler runs on a fixed rate tick with absolute
+// deadlines, so that its own runtime does not stretch the period.
+// A missed deadline is counted and the tick restarts from the present.
+// The stack has to hold the snapshots and the deepest handler chain,
+// drive_segments() or drive_positions() down to stageState(), plus the
+// TWI handler chain, the deepest ISR, beyond PORT_INT_REQUIRED_STACK.
+#define MOTOR_THREAD_STACK 512
+static THD_WORKING_AREA(waThreadMotor, MOTOR_THREAD_STACK);
 static THD_FUNCTION(ThreadMotor, arg) {
   (void)arg;
-  uint32_t delay;
+  TachoSnapshot tachos[MOTORS_NUMBER];
+  DriveModeHandler last_handler = NULL;
+  uint16_t wait_ticks = 0;
+  systime_t deadline = chVTGetSystemTime();
   while (true) {
-    if (MotorsController::motorscontroller->drive_mode_handler) {
-      delay = MotorsController::motorscontroller->drive_mode_handler();
+    // The TWI ISR can change the handler halfway through reading it.
+    chSysLock();
+    DriveModeHandler handler =
+      MotorsController::motorscontroller->drive_mode_handler;
+    uint8_t action = MotorsController::store_action;
+    MotorsController::store_action = STORE_NONE;
+    chSysUnlock();
+    if (handler != last_handler) {
+      last_handler = handler;
+      wait_ticks = 0;
+    }
+    if (action != STORE_NONE)
+      MotorsController::motorscontroller->store(action);
+    TachoMotors::tachomotors->updateObservers();
+    if (wait_ticks)
+      wait_ticks--;
+    if (!wait_ticks && handler) {
+      TachoMotors::tachomotors->getSnapshots(tachos);
+      wait_ticks = handler(tachos);
+    }
+    chSysLock();
+    systime_t period = MotorsController::tick_period;
+    systime_t now = chVTGetSystemTimeX();
+    if ((systime_t)(now - deadline) >= period) {
+      MotorsController::tick_overruns++;
+      deadline = now;
     } else {
-      delay = MOTOR_THREAD_IDLE_PERIOD_MS;
+      deadline += period;
+      chThdSleepS(deadline - now);
     }
-    chThdSleepMilliseconds(delay);
+    chSysUnlock();
   }
 }
 
+// Debug builds fill the working area with a pattern before starting
+// the thread: the bytes at its bottom still holding it were never used.
+#if defined(MOTORS_STACK_DEBUG)
+#define MOTOR_THREAD_STACK_FILL 0x55
+#endif
+
+static void
+motor_thread_stack_fill(void) {
+#if defined(MOTORS_STACK_DEBUG)
+  uint8_t *bottom = (uint8_t *)waThreadMotor;
+  for (uint16_t i = 0; i < sizeof(waThreadMotor); i++)
+    bottom[i] = MOTOR_THREAD_STACK_FILL;
+#endif
+}
+
+// Bytes of the motor thread stack never used since its creation,
+// 0 without MOTORS_STACK_DEBUG.
+static uint16_t
+motor_thread_stack_free(void) {
+  uint16_t free_bytes = 0;
+#if defined(MOTORS_STACK_DEBUG)
+  const uint8_t *bottom = (const uint8_t *)waThreadMotor + sizeof(thread_t);
+  const uint8_t *top = (const uint8_t *)waThreadMotor + sizeof(waThreadMotor);
+  while ((bottom < top) && (*bottom++ == MOTOR_THREAD_STACK_FILL))
+    free_bytes++;
+#endif
+  return free_bytes;
+}
+
 typedef enum {
-  WAIT_RAMP_UP_PWM_MIN_PERIOD = 125,
-  WAIT_RAMP_UP_PWM_STATIC_MIN_PWM = 50,
-  WAIT_PWM_SPEED_STABILIZE = 200,
+  WAIT_SPIN_UP = 300,
+  WAIT_MEASURE = 200,
+  WAIT_KICK = 100,
+  WAIT_SETTLE = 150,
+  WAIT_PROBE = 150,
+  WAIT_STOP = 250,
 } MotorDelays;
 
 typedef enum {
-  DELTA_PWM_MIN_PERIOD_RAMP_UP = 63,
-  DELTA_PWM_MIN_PWM_RAMP_UP = 15,
-  DELTA_PWM_MIN_PWM_RAMP_DOWN = 10,
-} DeltaCalibrate;
+  CALIBRATE_MIN_EDGES = 3,
+  CALIBRATE_PWM_RESOLUTION = 2,
+  CALIBRATE_SPREAD_SHIFT = 6,
+} CalibrateLimits;
 
+// For each direction, line through (dynamic_max_period, dynamic_min_pwm)
+// and (min_period, MAX_PWM). The division happens only here, once per
+// calibration, so that convert() is left with a multiply and a shift.
+// The periods must be at least 1/2^CALIBRATE_SPREAD_SHIFT of the longest
+// apart: a steeper line would overflow m * period in Q16.16.
 void
 calculate_parameters(void) {
-  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-    MotorsController::motorscontroller->m[i] =
-      ((float)(255 - MotorsController::motorscontroller->dynamic_min_pwms[i]) /
-       (float)(MotorsController::motorscontroller->min_periods[i] -
-               MotorsController::motorscontroller->dynamic_max_periods[i]));
-    MotorsController::motorscontroller->q[i] =
-      MotorsController::motorscontroller->dynamic_min_pwms[i] -
-      MotorsController::motorscontroller->m[i] *
-      MotorsController::motorscontroller->dynamic_max_periods[i];
-  }
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    for (uint8_t d = 0; d < DIRECTIONS; d++) {
+      int32_t delta_period =
+        (int32_t)MotorsController::motorscontroller->min_periods[i][d] -
+        (int32_t)MotorsController::motorscontroller->dynamic_max_periods[i][d];
+      uint8_t dynamic_min_pwm =
+        MotorsController::motorscontroller->dynamic_min_pwms[i][d];
+      if ((delta_period >= 0) ||
+          ((-delta_period << CALIBRATE_SPREAD_SHIFT) <=
+           (int32_t)MotorsController::motorscontroller->
+             dynamic_max_periods[i][d])) {
+        // Degenerate calibration: fall back to a constant.
+        MotorsController::motorscontroller->m[i][d] = 0;
+        MotorsController::motorscontroller->q[i][d] =
+          int_to_fixed(dynamic_min_pwm);
+        continue;
+      }
+      fixed_t m = int_to_fixed(MAX_PWM - dynamic_min_pwm) / delta_period;
+      MotorsController::motorscontroller->m[i][d] = m;
+      MotorsController::motorscontroller->q[i][d] =
+        int_to_fixed(dynamic_min_pwm) -
+        m * (int32_t)MotorsController::motorscontroller->
+              dynamic_max_periods[i][d];
+    }
 }
 
-uint32_t
-calibrate_motors(void) {
-  uint32_t wait_ms = 0;
-  palSetPad(IOPORT2, PB5);
-  switch (MotorsController::motorscontroller->drive_step) {
-    case CALIBRATE_STATIC_MIN_PWM_INIT: {
-      systime_t init_time = chVTGetSystemTimeX();
-      for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-        TachoMotors::tachomotors->motors[i].resetMotorPeriod(init_time);
-        MotorsController::motorscontroller->min_periods[i] = 0;
-        MotorsController::motorscontroller->static_max_periods[i] = 0;
-        MotorsController::motorscontroller->dynamic_max_periods[i] = 0;
-        MotorsController::motorscontroller->static_min_pwms[i] = 0;
-        MotorsController::motorscontroller->dynamic_min_pwms[i] = 0;
-        MotorsController::motorscontroller->set_motor_raw(i, 0, FORWARD);
-      }
-      MotorsController::motorscontroller->drive_step =
-        CALIBRATE_STATIC_MIN_PWM_RAMP_UP;
+static void
+open_window(MotorCalibration &calibration, const TachoSnapshot &tacho,
+            systime_t now, uint16_t ms) {
+  calibration.counter = tacho.counter;
+  calibration.hires_event = tacho.last_hires_event;
+  calibration.deadline = now + MS2ST(ms);
+}
+
+static uint16_t
+window_edges(const MotorCalibration &calibration, const TachoSnapshot &tacho) {
+  return tacho.counter - calibration.counter;
+}
+
+// Average period of the edges seen in the window, 0 if too few.
+static systime_t
+window_period(const MotorCalibration &calibration,
+              const TachoSnapshot &tacho) {
+  uint16_t edges = window_edges(calibration, tacho);
+  if (edges < 2)
+    return 0;
+  return HT2ST((tacho.last_hires_event - calibration.hires_event) / edges);
+}
+
+// Invariant of both bisections: the motor does not move at low and
+// does at high. A probe that still spins allows to go straight to the
+// next, lower, probe; otherwise the motor is kicked at full PWM again.
+void
+calibrate_motor(uint8_t motor, const TachoSnapshot &tacho, systime_t now) {
+  MotorCalibration &calibration =
+    MotorsController::motorscontroller->calibrations[motor];
+  uint8_t direction = calibration.direction;
+  uint8_t probe = (calibration.low + calibration.high) / 2;
+  switch (calibration.step) {
+    case CALIBRATE_MIN_PERIOD_SPIN_UP: {
+      open_window(calibration, tacho, now, WAIT_MEASURE);
+      calibration.step = CALIBRATE_MIN_PERIOD_MEASURE;
     } break;
-    case CALIBRATE_STATIC_MIN_PWM_RAMP_UP: {
-      bool done = TRUE;
-      for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
-        if (TachoMotors::tachomotors->motors[i].getAvgPeriod() == 0) {
-          done = FALSE;
-          MotorsDriver::motorsdriver->
-              increasePWM(i, DELTA_PWM_MIN_PWM_RAMP_UP);
-        }
-      if (done) {
-        for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
-          MotorsController::motorscontroller->static_max_periods[i] =
-              TachoMotors::tachomotors->motors[i].getAvgPeriod();
-        MotorsController::motorscontroller->drive_step =
-          CALIBRATE_STATIC_MIN_PWM_MEASURE;
-      } else {
-        wait_ms = WAIT_RAMP_UP_PWM_STATIC_MIN_PWM;
-      }
+    case CALIBRATE_MIN_PERIOD_MEASURE: {
+      systime_t period = window_period(calibration, tacho);
+      MotorsController::motorscontroller->min_periods[motor][direction] = period;
+      MotorsController::motorscontroller->dynamic_max_periods[motor][direction] = period;
+      MotorsController::motorscontroller->static_max_periods[motor][direction] = period;
+      calibration.low = 0;
+      calibration.high = MAX_PWM;
+      MotorsDriver::motorsdriver->setPWM(motor, MAX_PWM / 2);
+      calibration.deadline = now + MS2ST(WAIT_SETTLE);
+      calibration.step = CALIBRATE_DYNAMIC_MIN_PWM_SETTLE;
     } break;
-    case CALIBRATE_STATIC_MIN_PWM_MEASURE: {
-      for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-        MotorsController::motorscontroller->static_min_pwms[i] =
-            MotorsDriver::motorsdriver->getPWM(i);
-      }
-      MotorsController::motorscontroller->drive_step =
-          CALIBRATE_MIN_PERIOD_RAMP_UP;
-      wait_ms = WAIT_PWM_SPEED_STABILIZE;
+    case CALIBRATE_DYNAMIC_MIN_PWM_KICK: {
+      MotorsDriver::motorsdriver->setPWM(motor, probe);
+      calibration.deadline = now + MS2ST(WAIT_SETTLE);
+      calibration.step = CALIBRATE_DYNAMIC_MIN_PWM_SETTLE;
     } break;
-    case CALIBRATE_MIN_PERIOD_RAMP_UP: {
-      bool done = TRUE;
-      for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
-        if (MotorsDriver::motorsdriver->getPWM(i) != 0xff) {
-          done = FALSE;
-          MotorsDriver::motorsdriver->
-              increasePWM(i, DELTA_PWM_MIN_PERIOD_RAMP_UP);
-        }
-      if (done) {
-        MotorsController::motorscontroller->drive_step =
-          CALIBRATE_MIN_PERIOD_MEASURE;
+    case CALIBRATE_DYNAMIC_MIN_PWM_SETTLE: {
+      open_window(calibration, tacho, now, WAIT_PROBE);
+      calibration.step = CALIBRATE_DYNAMIC_MIN_PWM_PROBE;
+    } break;
+    case CALIBRATE_DYNAMIC_MIN_PWM_PROBE: {
+      bool spinning = window_edges(calibration, tacho) >= CALIBRATE_MIN_EDGES;
+      if (spinning) {
+        calibration.high = probe;
+        MotorsController::motorscontroller->dynamic_max_periods[motor][direction] =
+          window_period(calibration, tacho);
+      } else {
+        calibration.low = probe;
+      }
+      if ((calibration.high - calibration.low) <= CALIBRATE_PWM_RESOLUTION) {
+        MotorsController::motorscontroller->dynamic_min_pwms[motor][direction] =
+          calibration.high;
+        // The table is sampled from the top, where the motor surely spins.
+        calibration.point = PWM_TABLE_POINTS - 1;
+        MotorsController::motorscontroller->
+          pwm_table_pwms[motor][direction][calibration.point] = MAX_PWM;
+        MotorsDriver::motorsdriver->setPWM(motor, MAX_PWM);
+        calibration.deadline = now + MS2ST(WAIT_SPIN_UP);
+        calibration.step = CALIBRATE_PWM_TABLE_SETTLE;
+      } else if (spinning) {
+        MotorsDriver::motorsdriver->setPWM(
+          motor, (calibration.low + calibration.high) / 2);
+        calibration.deadline = now + MS2ST(WAIT_SETTLE);
+        calibration.step = CALIBRATE_DYNAMIC_MIN_PWM_SETTLE;
       } else {
-        wait_ms = WAIT_RAMP_UP_PWM_MIN_PERIOD;
+        MotorsDriver::motorsdriver->setPWM(motor, MAX_PWM);
+        calibration.deadline = now + MS2ST(WAIT_KICK);
+        calibration.step = CALIBRATE_DYNAMIC_MIN_PWM_KICK;
       }
     } break;
-    case CALIBRATE_MIN_PERIOD_MEASURE: {
-      for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-        MotorsController::motorscontroller->min_periods[i] =
-            TachoMotors::tachomotors->motors[i].getAvgPeriod();
+    case CALIBRATE_PWM_TABLE_SETTLE: {
+      open_window(calibration, tacho, now, WAIT_MEASURE);
+      calibration.step = CALIBRATE_PWM_TABLE_MEASURE;
+    } break;
+    case CALIBRATE_PWM_TABLE_MEASURE: {
+      volatile packed_period_t *periods =
+        MotorsController::motorscontroller->pwm_table_periods[motor][direction];
+      uint8_t point = calibration.point;
+      systime_t period = window_period(calibration, tacho);
+      // A stalled motor counts as the slowest one seen and the periods
+      // are kept monotonic, for the interpolation.
+      if (period == 0)
+        period = MotorsController::motorscontroller->
+                   dynamic_max_periods[motor][direction];
+      if ((point < PWM_TABLE_POINTS - 1) && (period < periods[point + 1]))
+        period = periods[point + 1];
+      periods[point] = period;
+      if (point == 0) {
+        MotorsController::motorscontroller->pwm_table_mask |=
+          calibration_bit(motor, direction);
+        // Below the dynamic minimum, the motor cannot start either.
+        calibration.low =
+          MotorsController::motorscontroller->dynamic_min_pwms[motor][direction] - 1;
+        calibration.high = MAX_PWM;
+        MotorsDriver::motorsdriver->setPWM(motor, 0);
+        calibration.deadline = now + MS2ST(WAIT_STOP);
+        calibration.step = CALIBRATE_STATIC_MIN_PWM_STOP;
+      } else {
+        uint8_t dynamic_min_pwm =
+          MotorsController::motorscontroller->dynamic_min_pwms[motor][direction];
+        uint8_t pwm = dynamic_min_pwm +
+          ((uint16_t)(MAX_PWM - dynamic_min_pwm) * (point - 1)) /
+          (PWM_TABLE_POINTS - 1);
+        calibration.point = point - 1;
+        MotorsController::motorscontroller->
+          pwm_table_pwms[motor][direction][calibration.point] = pwm;
+        MotorsDriver::motorsdriver->setPWM(motor, pwm);
+        calibration.deadline = now + MS2ST(WAIT_SETTLE);
+        calibration.step = CALIBRATE_PWM_TABLE_SETTLE;
       }
-      MotorsController::motorscontroller->drive_step =
-            CALIBRATE_DYNAMIC_MIN_PWM_RAMP_DOWN;
     } break;
-    case CALIBRATE_DYNAMIC_MIN_PWM_RAMP_DOWN: {
-      systime_t current_time = chVTGetSystemTimeX();
-      bool done = TRUE;
-      for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-        systime_t elapsed_time =
-            current_time - TachoMotors::tachomotors->motors[i].getLastEvent();
-        if (elapsed_time < MS2ST(250)) {
-          done = FALSE;
-          MotorsDriver::motorsdriver->
-              decreasePWM(i, DELTA_PWM_MIN_PWM_RAMP_DOWN);
+    case CALIBRATE_STATIC_MIN_PWM_STOP: {
+      if (tacho.avg_hires_period != 0) {
+        calibration.deadline = now + MS2ST(WAIT_STOP);
+      } else if ((calibration.high - calibration.low) <=
+                 CALIBRATE_PWM_RESOLUTION) {
+        MotorsController::motorscontroller->static_min_pwms[motor][direction] =
+          calibration.high;
+        if (direction == DIRECTION_FORWARD) {
+          calibration.direction = DIRECTION_BACKWARD;
+          MotorsController::motorscontroller->set_motor_raw(motor, MAX_PWM,
+                                                            BACKWARD);
+          calibration.deadline = now + MS2ST(WAIT_SPIN_UP);
+          calibration.step = CALIBRATE_MIN_PERIOD_SPIN_UP;
+        } else {
+          MotorsController::motorscontroller->set_motor_raw(motor, 0, IDLE);
+          calibration.step = CALIBRATE_DONE;
         }
-      }
-      if (done) {
-        MotorsController::motorscontroller->drive_step =
-          CALIBRATE_DYNAMIC_MIN_PWM_MEASURE;
       } else {
-        wait_ms = WAIT_PWM_SPEED_STABILIZE;
+        MotorsDriver::motorsdriver->setPWM(motor, probe);
+        open_window(calibration, tacho, now, WAIT_PROBE);
+        calibration.step = CALIBRATE_STATIC_MIN_PWM_PROBE;
       }
     } break;
-    case CALIBRATE_DYNAMIC_MIN_PWM_MEASURE: {
-      for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-        MotorsController::motorscontroller->dynamic_min_pwms[i] =
-            MotorsDriver::motorsdriver->getPWM(i) +
-            DELTA_PWM_MIN_PWM_RAMP_DOWN;
-        MotorsController::motorscontroller->set_motor_raw(i, 0, IDLE);
+    case CALIBRATE_STATIC_MIN_PWM_PROBE: {
+      if (window_edges(calibration, tacho) >= CALIBRATE_MIN_EDGES) {
+        calibration.high = probe;
+        MotorsController::motorscontroller->static_max_periods[motor][direction] =
+          window_period(calibration, tacho);
+      } else {
+        calibration.low = probe;
       }
-      calculate_parameters();
-      MotorsController::motorscontroller->drive_step = DRIVE_NOP;
-      MotorsController::motorscontroller->drive_mode_handler = NULL;
+      MotorsDriver::motorsdriver->setPWM(motor, 0);
+      calibration.deadline = now + MS2ST(WAIT_STOP);
+      calibration.step = CALIBRATE_STATIC_MIN_PWM_STOP;
     } break;
   }
+}
+
+// The motors advance independently, each when its own deadline expires.
+uint16_t
+calibrate_motors(const TachoSnapshot *tachos) {
+  palSetPad(IOPORT2, PB5);
+  systime_t now = chVTGetSystemTimeX();
+  if (MotorsController::motorscontroller->drive_step == DRIVE_INIT) {
+    for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+      MotorCalibration &calibration =
+        MotorsController::motorscontroller->calibrations[i];
+      MotorsController::motorscontroller->set_motor_raw(i, MAX_PWM, FORWARD);
+      calibration.low = 0;
+      calibration.high = MAX_PWM;
+      calibration.direction = DIRECTION_FORWARD;
+      calibration.deadline = now + MS2ST(WAIT_SPIN_UP);
+      calibration.step = CALIBRATE_MIN_PERIOD_SPIN_UP;
+    }
+    MotorsController::motorscontroller->pwm_table_mask = 0;
+    MotorsController::motorscontroller->drive_step = DRIVE_CONTINUE;
+  }
+  bool done = TRUE;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    MotorCalibration &calibration =
+      MotorsController::motorscontroller->calibrations[i];
+    if (calibration.step == CALIBRATE_DONE)
+      continue;
+    done = FALSE;
+    if ((systime_t)(now - calibration.deadline) < (systime_t)~0 / 2)
+      calibrate_motor(i, tachos[i], now);
+  }
+  if (done) {
+    calculate_parameters();
+    MotorsController::motorscontroller->drive_step = DRIVE_NOP;
+    chSysLock();
+    if (MotorsController::motorscontroller->drive_mode_handler ==
+        calibrate_motors)
+      MotorsController::motorscontroller->drive_mode_handler = NULL;
+    chSysUnlock();
+  }
   palClearPad(IOPORT2, PB5);
-  return wait_ms;
+  return 0;
+}
+
+static_assert(PWM_TABLE_POINTS <= 8,
+              "The table index has 3 bits for the point.");
+
+// Linear interpolation between the two points of the table around the
+// period, which is clamped to the range of the table.
+static uint8_t
+interpolate(uint8_t motor, uint8_t direction, systime_t period) {
+  volatile uint8_t *pwms = MotorsController::pwm_table_pwms[motor][direction];
+  volatile packed_period_t *periods =
+    MotorsController::pwm_table_periods[motor][direction];
+  if (period >= periods[0])
+    return pwms[0];
+  for (uint8_t i = 1; i < PWM_TABLE_POINTS; i++)
+    if (period > periods[i])
+      return pwms[i - 1] +
+             ((uint32_t)(pwms[i] - pwms[i - 1]) * (periods[i - 1] - period)) /
+             (periods[i - 1] - periods[i]);
+  return pwms[PWM_TABLE_POINTS - 1];
 }
 
+// Feedforward: PWM expected to produce the given period, according to
+// the table sampled by the calibration or, lacking it, to the linear
+// model. The period is clamped to the calibrated range, which also
+// keeps the product within 32 bits.
 uint8_t
 convert(uint8_t motor, packed_period_t packed_period) {
+  systime_t period = get_packed_period(packed_period);
+  uint8_t d = get_packed_direction_index(packed_period);
+  if (period == 0)
+    return 0;
+  if (MotorsController::motorscontroller->pwm_table_mask &
+      calibration_bit(motor, d))
+    return interpolate(motor, d, period);
+  if (period < MotorsController::motorscontroller->min_periods[motor][d])
+    period = MotorsController::motorscontroller->min_periods[motor][d];
+  else if (period >
+           MotorsController::motorscontroller->dynamic_max_periods[motor][d])
+    period = MotorsController::motorscontroller->dynamic_max_periods[motor][d];
+  int16_t pwm = fixed_to_int(MotorsController::motorscontroller->m[motor][d] *
+                             (int32_t)period +
+                             MotorsController::motorscontroller->q[motor][d]);
+  if (pwm < 0)
+    return 0;
+  if (pwm > MAX_PWM)
+    return MAX_PWM;
+  return (uint8_t)pwm;
+}
+
+typedef enum {
+  CRUISE_GAIN_SHIFT = 8,
+  CRUISE_DEFAULT_KP = 64,
+  CRUISE_DEFAULT_KI = 8,
+} CruiseGains;
+
+static_assert((int)CRUISE_GAIN_SHIFT >= (int)PWM_HIRES_SHIFT,
+              "The cruise output must have at least the PWM resolution.");
+
+#define CRUISE_MAX_INTEGRAL ((int32_t)MAX_PWM << CRUISE_GAIN_SHIFT)
+
+typedef enum {
+  SYNC_DEFAULT_KP = 0,
+  SYNC_MAX_ERROR = 64,
+} SyncLimits;
+
+// Cross coupling of linked motors sharing the same target: each one is
+// slowed down by how many edges it is ahead of its partner, counted
+// since the pair started sharing the target, and the partner sped up
+// by the same amount. The error is saturated, to bound the correction.
+// The gain is in the same units as the cruise ones; 0 disables it.
+static void
+sync_errors(const TachoSnapshot tachos[MOTORS_NUMBER],
+            int16_t errors[MOTORS_NUMBER]) {
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    uint8_t partner = MotorsController::linkage[i];
+    errors[i] = 0;
+    chSysLock();
+    packed_period_t target = MotorsController::target_periods[i];
+    bool shared = (target == MotorsController::target_periods[partner]);
+    chSysUnlock();
+    if ((MotorsController::sync_kp == 0) || !shared ||
+        (get_packed_period(target) == 0)) {
+      MotorsController::sync_mask &= ~_BV(i);
+      continue;
+    }
+    // Both motors of a newly synchronized pair start from here.
+    if (!(MotorsController::sync_mask & _BV(i))) {
+      MotorsController::sync_mask |= _BV(i) | _BV(partner);
+      MotorsController::sync_references[i] = tachos[i].counter;
+      MotorsController::sync_references[partner] = tachos[partner].counter;
+    }
+    int32_t error =
+      (int32_t)((tachos[i].counter - MotorsController::sync_references[i]) -
+                (tachos[partner].counter -
+                 MotorsController::sync_references[partner]));
+    if (error > SYNC_MAX_ERROR)
+      error = SYNC_MAX_ERROR;
+    else if (error < -SYNC_MAX_ERROR)
+      error = -SYNC_MAX_ERROR;
+    errors[i] = error;
+  }
+}
+
+typedef enum {
+  TRACTION_DEFAULT_SLIP_RATIO = 384,
+  TRACTION_DEFAULT_STALL_PWM = 128,
+  TRACTION_DEFAULT_STALL_TIME = 300,
+  TRACTION_NO_REDUCTION = 256,
+} TractionDefaults;
+
+// A motor stalls when it gets at least the stall PWM without producing
+// edges for the stall time, and slips when it spins faster than its
+// linked partner, running in the same direction, by the slip ratio.
+// A stall is latched until edges reappear, or the motor is stopped,
+// since the reduction itself brings the PWM below the threshold.
+static void
+detect_traction(const TachoSnapshot tachos[MOTORS_NUMBER]) {
+  uint16_t *parameters = MotorsController::traction_parameters;
+  uint16_t stall_ticks = MotorsController::ms_to_ticks(
+                           parameters[TRACTION_STALL_TIME]);
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    uint8_t partner = MotorsController::linkage[i];
+    uint8_t flags = 0;
+    chSysLock();
+    packed_period_t target = MotorsController::target_periods[i];
+    packed_period_t partner_target = MotorsController::target_periods[partner];
+    chSysUnlock();
+    if ((tachos[i].counter == MotorsController::traction_counters[i]) &&
+        (get_packed_period(target) != 0) &&
+        ((MotorsController::traction_flags[i] & TRACTION_STALL) ||
+         (MotorsDriver::motorsdriver->getPWM(i) >=
+          parameters[TRACTION_STALL_PWM]))) {
+      if (MotorsController::stall_ticks[i] < stall_ticks)
+        MotorsController::stall_ticks[i]++;
+      else
+        flags |= TRACTION_STALL;
+    } else {
+      MotorsController::stall_ticks[i] = 0;
+    }
+    MotorsController::traction_counters[i] = tachos[i].counter;
+    if ((get_packed_period(target) != 0) &&
+        (get_packed_period(partner_target) != 0) &&
+        !((target ^ partner_target) & PACKED_PERIOD_DIRECTION_MASK) &&
+        (tachos[i].avg_hires_period != 0) &&
+        (tachos[partner].avg_hires_period != 0) &&
+        (((uint32_t)tachos[partner].avg_hires_period << 8) >
+         (uint32_t)tachos[i].avg_hires_period *
+         parameters[TRACTION_SLIP_RATIO]))
+      flags |= TRACTION_SLIP;
+    MotorsController::traction_flags[i] = flags;
+  }
+}
+
+// PI correction on top of the feedforward, in fixed point.
+// The error is measured in high resolution ticks and the gains are
+// expressed in 1/2^CRUISE_GAIN_SHIFT of PWM step per tick of error.
+// A period longer than the target means the motor is too slow.
+uint16_t
+cruise(const TachoSnapshot *tachos) {
+  int16_t sync[MOTORS_NUMBER];
+  if (MotorsController::motorscontroller->drive_step == DRIVE_INIT) {
+    for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+      MotorsController::motorscontroller->cruise_integrals[i] = 0;
+      MotorsController::motorscontroller->real_target_periods[i] = 0;
+    }
+    MotorsController::motorscontroller->stop_lock_mask = 0;
+    MotorsController::motorscontroller->sync_mask = 0;
+    MotorsController::motorscontroller->drive_step = DRIVE_CONTINUE;
+  }
+  sync_errors(tachos, sync);
+  detect_traction(tachos);
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    chSysLock();
+    packed_period_t target = MotorsController::motorscontroller->
+                               target_periods[i];
+    chSysUnlock();
+    uint8_t direction = get_packed_direction(target);
+    systime_t period = get_packed_period(target);
+    if ((period == 0) ||
+        ((target ^ MotorsController::motorscontroller->
+                     real_target_periods[i]) & PACKED_PERIOD_DIRECTION_MASK))
+      MotorsController::motorscontroller->cruise_integrals[i] = 0;
+    MotorsController::motorscontroller->real_target_periods[i] = target;
+    if (period == 0) {
+      MotorsController::motorscontroller->stage_motor_raw(
+        i, 0,
+        (MotorsController::motorscontroller->stop_lock_mask & _BV(i)) ?
+          LOCK : IDLE);
+      continue;
+    }
+    int32_t output = (int32_t)convert(i, target) << CRUISE_GAIN_SHIFT;
+    bool reduced = MotorsController::traction_flags[i] &&
+                   (MotorsController::traction_parameters[TRACTION_REDUCTION] <
+                    TRACTION_NO_REDUCTION);
+    // Without a measurement, yet or any longer, rely only on the
+    // feedforward.
+    // The integral is frozen while the PWM is reduced.
+    if ((tachos[i].avg_hires_period != 0) && !reduced &&
+        (MotorsDriver::motorsdriver->getState(i) == direction)) {
+      int32_t error = (int32_t)tachos[i].avg_hires_period -
+                      (int32_t)ST2HT(period);
+      int32_t integral = MotorsController::motorscontroller->
+                           cruise_integrals[i] +
+                         error * MotorsController::motorscontroller->cruise_ki;
+      if (integral > CRUISE_MAX_INTEGRAL)
+        integral = CRUISE_MAX_INTEGRAL;
+      else if (integral < -CRUISE_MAX_INTEGRAL)
+        integral = -CRUISE_MAX_INTEGRAL;
+      output += error * MotorsController::motorscontroller->cruise_kp;
+      // Anti windup: the integral is not updated while saturated.
+      if (((output + integral) >> CRUISE_GAIN_SHIFT) <= MAX_PWM &&
+          (output + integral) >= 0)
+        MotorsController::motorscontroller->cruise_integrals[i] = integral;
+      output += MotorsController::motorscontroller->cruise_integrals[i];
+    }
+    output -= (int32_t)sync[i] * MotorsController::motorscontroller->sync_kp;
+    if (reduced && (output > 0))
+      output = (output >> 8) *
+               MotorsController::traction_parameters[TRACTION_REDUCTION];
+    if (output < 0)
+      output = 0;
+    else if ((output >> CRUISE_GAIN_SHIFT) > MAX_PWM)
+      output = (int32_t)MAX_PWM << CRUISE_GAIN_SHIFT;
+    // The fraction of the output is kept, to be dithered.
+    MotorsDriver::motorsdriver->stageHiresPWM(
+      i, output >> (CRUISE_GAIN_SHIFT - PWM_HIRES_SHIFT));
+    MotorsDriver::motorsdriver->stageState(i, (MotorStates)direction);
+  }
+  MotorsDriver::motorsdriver->commit();
   return 0;
 }
 
-//uint32_t
-//cruise(void) {
-//  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-//    uint8_t current_direction = MotorsDriver::motorsdriver->getState(i);
-//    systime_t current_period = 0;
-//    if (current_direction != IDLE && current_direction != LOCK) {
-//      current_period = TachoMotors::tachomotors->motors[i].getAvgPeriod();
-//    }
-//    systime_t target =
-//      MotorsController::motorscontroller->real_target_periods[i];
-///*    systime_t current =
-//      TachoMotors::tachomotors->motors[i].getAvgPeriod() |
-//      ((MotorsDriver::motorsdriver->getState(i) == BACKWARD) & 0x8000);*/
-//  }
-//  return WAIT_PWM_SPEED_STABILIZE;
-//}
+// Cruise, with the targets derived from the velocity of the vehicle,
+// recomputed only when a new command arrives.
+uint16_t
+drive_velocity(const TachoSnapshot *tachos) {
+  static uint8_t applied_sequence;
+  chSysLock();
+  uint8_t sequence = MotorsController::velocity_sequence;
+  int16_t linear = MotorsController::velocity.linear;
+  int16_t yaw = MotorsController::velocity.yaw;
+  chSysUnlock();
+  if ((MotorsController::motorscontroller->drive_step == DRIVE_INIT) ||
+      (sequence != applied_sequence)) {
+    applied_sequence = sequence;
+    int32_t delta = ((int32_t)yaw * WHEEL_BASE_MM) / 2000;
+    for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+      packed_period_t period = MotorsController::wheel_period(
+        (VEHICLE_LEFT_MOTORS & _BV(i)) ? linear - delta : linear + delta);
+      chSysLock();
+      MotorsController::motorscontroller->target_periods[i] = period;
+      chSysUnlock();
+    }
+  }
+  return cruise(tachos);
+}
+
+// Motors involved in a segment.
+static uint8_t
+segment_motors(const MotionSegment &segment) {
+  if (segment.flags & SEGMENT_VEHICLE)
+    return _BV(MOTORS_NUMBER) - 1;
+  return segment.mask & (_BV(MOTORS_NUMBER) - 1);
+}
+
+static void
+start_segment(const TachoSnapshot tachos[MOTORS_NUMBER]) {
+  MotionSegment &segment = MotorsController::active_segment;
+  uint8_t motors = segment_motors(segment);
+  int32_t delta = ((int32_t)segment.target.velocity.yaw * WHEEL_BASE_MM) /
+                  2000;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    if (!(motors & _BV(i)))
+      continue;
+    packed_period_t period = segment.target.period;
+    if (segment.flags & SEGMENT_VEHICLE)
+      period = MotorsController::wheel_period(
+        (VEHICLE_LEFT_MOTORS & _BV(i)) ?
+          segment.target.velocity.linear - delta :
+          segment.target.velocity.linear + delta);
+    MotorsController::segment_counters[i] = tachos[i].counter;
+    chSysLock();
+    MotorsController::target_periods[i] = period;
+    chSysUnlock();
+  }
+  MotorsController::stop_lock_mask &= ~motors;
+  MotorsController::segment_remaining = (segment.flags & SEGMENT_DISTANCE) ?
+    segment.length : MotorsController::ms_to_ticks(segment.length);
+  MotorsController::segment_number++;
+  MotorsController::segment_active = true;
+}
+
+// Updates what remains of the active segment, true when it is over.
+static bool
+segment_done(const TachoSnapshot tachos[MOTORS_NUMBER]) {
+  MotionSegment &segment = MotorsController::active_segment;
+  if (!(segment.flags & SEGMENT_DISTANCE)) {
+    if (MotorsController::segment_remaining)
+      MotorsController::segment_remaining--;
+  } else {
+    uint8_t motors = segment_motors(segment);
+    uint32_t edges = 0;
+    uint8_t motors_nr = 0;
+    for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+      if (motors & _BV(i)) {
+        edges += tachos[i].counter - MotorsController::segment_counters[i];
+        motors_nr++;
+      }
+    edges = motors_nr ? edges / motors_nr : segment.length;
+    MotorsController::segment_remaining =
+      (edges < segment.length) ? segment.length - edges : 0;
+  }
+  return MotorsController::segment_remaining == 0;
+}
+
+static void
+end_segment(void) {
+  MotionSegment &segment = MotorsController::active_segment;
+  uint8_t motors = segment_motors(segment);
+  uint8_t end = segment.flags & SEGMENT_END_MASK;
+  MotorsController::segment_active = false;
+  if (end == SEGMENT_END_CONTINUE)
+    return;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    if (motors & _BV(i)) {
+      chSysLock();
+      MotorsController::target_periods[i] = 0;
+      chSysUnlock();
+    }
+  if (end == SEGMENT_END_LOCK)
+    MotorsController::stop_lock_mask |= motors;
+}
+
+// Executes the queued segments back to back, on the control tick,
+// with the cruise controller holding the speeds.
+uint16_t
+drive_segments(const TachoSnapshot *tachos) {
+  if (MotorsController::motorscontroller->drive_step == DRIVE_INIT) {
+    MotorsController::segment_active = false;
+    MotorsController::segment_number = 0;
+  }
+  chSysLock();
+  bool flush = MotorsController::segments_flush;
+  MotorsController::segments_flush = false;
+  chSysUnlock();
+  if (flush && MotorsController::segment_active) {
+    MotorsController::active_segment.flags =
+      (MotorsController::active_segment.flags & ~SEGMENT_END_MASK) |
+      SEGMENT_END_IDLE;
+    end_segment();
+  }
+  if (MotorsController::segment_active && segment_done(tachos))
+    end_segment();
+  if (!MotorsController::segment_active) {
+    chSysLock();
+    bool available = MotorsController::segments_tail !=
+                     MotorsController::segments_head;
+    if (available) {
+      MotorsController::active_segment =
+        MotorsController::segments[MotorsController::segments_tail &
+                                   MOTION_QUEUE_MASK];
+      MotorsController::segments_tail++;
+    }
+    chSysUnlock();
+    if (available)
+      start_segment(tachos);
+  }
+  return cruise(tachos);
+}
+
+// Profile speeds are in edges/s, with POSITION_SPEED_SHIFT fractional
+// bits, so that small accelerations still add up at high tick rates.
+typedef enum {
+  POSITION_SPEED_SHIFT = 8,
+} PositionSpeedResolution;
+
+static uint16_t
+isqrt(uint32_t x) {
+  uint32_t root = 0;
+  for (uint32_t bit = (uint32_t)1 << 30; bit; bit >>= 2)
+    if (x >= root + bit) {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  return root;
+}
+
+// Highest speed, in edges/s, from which the motor can still stop within
+// the remaining edges: v^2 = 2 * a * d.
+static uint32_t
+braking_speed(uint16_t acceleration, uint32_t remaining) {
+  uint32_t limit = (uint32_t)0xFFFFFFFF / (2 * (uint32_t)acceleration);
+  if (remaining > limit)
+    return 0xFFFF;
+  return isqrt(2 * (uint32_t)acceleration * remaining);
+}
+
+// Each motor with a move in progress follows its profile, with the
+// cruise controller tracking the speed, until the counter reaches the
+// target.
+uint16_t
+drive_positions(const TachoSnapshot *tachos) {
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    chSysLock();
+    bool active = MotorsController::position_mask & _BV(i);
+    uint8_t flags = MotorsController::position_flags[i];
+    int32_t remaining = MotorsController::position_targets[i] -
+                        tachos[i].counter;
+    uint16_t max_speed = MotorsController::position_max_speeds[i];
+    uint16_t acceleration = MotorsController::position_accelerations[i];
+    MotorsController::position_remaining[i] = remaining;
+    chSysUnlock();
+    if (!active)
+      continue;
+    packed_period_t period = 0;
+    if (remaining <= 0) {
+      chSysLock();
+      MotorsController::position_mask &= ~_BV(i);
+      chSysUnlock();
+      if (flags & POSITION_LOCK)
+        MotorsController::stop_lock_mask |= _BV(i);
+      MotorsController::position_speeds[i] = 0;
+    } else {
+      uint32_t speed = MotorsController::position_speeds[i] +
+        ((uint32_t)acceleration << POSITION_SPEED_SHIFT) /
+        MotorsController::tick_rate;
+      uint32_t limit = braking_speed(acceleration, remaining);
+      if (limit > max_speed)
+        limit = max_speed;
+      limit <<= POSITION_SPEED_SHIFT;
+      if (speed > limit)
+        speed = limit;
+      MotorsController::position_speeds[i] = speed;
+      uint32_t real_period = speed ?
+        ((uint32_t)CH_CFG_ST_FREQUENCY << POSITION_SPEED_SHIFT) / speed : 0;
+      if ((real_period == 0) || (real_period > PACKED_PERIOD_MASK))
+        real_period = PACKED_PERIOD_MASK;
+      period = real_period |
+        ((flags & POSITION_BACKWARD) ? PACKED_PERIOD_DIRECTION_MASK : 0);
+    }
+    chSysLock();
+    MotorsController::target_periods[i] = period;
+    chSysUnlock();
+  }
+  return cruise(tachos);
+}
 
 DriveModeHandler
 MotorsController::drive_mode_handler = NULL;
@@ -337,13 +1180,13 @@ MotorsController *
 MotorsController::motorscontroller = NULL;
 
 volatile packed_period_t
-MotorsController::min_periods[MOTORS_NUMBER];
+MotorsController::min_periods[MOTORS_NUMBER][DIRECTIONS];
 
 volatile packed_period_t
-MotorsController::static_max_periods[MOTORS_NUMBER];
+MotorsController::static_max_periods[MOTORS_NUMBER][DIRECTIONS];
 
 volatile packed_period_t
-MotorsController::dynamic_max_periods[MOTORS_NUMBER];
+MotorsController::dynamic_max_periods[MOTORS_NUMBER][DIRECTIONS];
 
 volatile packed_period_t
 MotorsController::target_periods[MOTORS_NUMBER];
@@ -352,23 +1195,355 @@ volatile packed_period_t
 MotorsController::real_target_periods[MOTORS_NUMBER];
 
 volatile uint8_t
-MotorsController::static_min_pwms[MOTORS_NUMBER];
+MotorsController::static_min_pwms[MOTORS_NUMBER][DIRECTIONS];
+
+volatile uint8_t
+MotorsController::dynamic_min_pwms[MOTORS_NUMBER][DIRECTIONS];
+
+MotorCalibration
+MotorsController::calibrations[MOTORS_NUMBER];
+
+volatile uint8_t
+MotorsController::pwm_table_mask;
+
+volatile uint8_t
+MotorsController::pwm_table_pwms[MOTORS_NUMBER][DIRECTIONS][PWM_TABLE_POINTS];
+
+volatile packed_period_t
+MotorsController::pwm_table_periods[MOTORS_NUMBER][DIRECTIONS]
+                                   [PWM_TABLE_POINTS];
+
+volatile fixed_t
+MotorsController::m[MOTORS_NUMBER][DIRECTIONS];
+
+volatile fixed_t
+MotorsController::q[MOTORS_NUMBER][DIRECTIONS];
+
+int32_t
+MotorsController::cruise_integrals[MOTORS_NUMBER];
+
+int16_t
+MotorsController::cruise_kp = CRUISE_DEFAULT_KP;
+
+int16_t
+MotorsController::cruise_ki = CRUISE_DEFAULT_KI;
+
+int16_t
+MotorsController::sync_kp = SYNC_DEFAULT_KP;
+
+uint8_t
+MotorsController::sync_mask;
+
+uint32_t
+MotorsController::sync_references[MOTORS_NUMBER];
+
+volatile Motors
+MotorsController::linkage[MOTORS_NUMBER];
+
+uint16_t
+MotorsController::traction_parameters[TRACTION_PARAMETERS] = {
+  [TRACTION_SLIP_RATIO] = TRACTION_DEFAULT_SLIP_RATIO,
+  [TRACTION_STALL_PWM] = TRACTION_DEFAULT_STALL_PWM,
+  [TRACTION_STALL_TIME] = TRACTION_DEFAULT_STALL_TIME,
+  [TRACTION_REDUCTION] = TRACTION_NO_REDUCTION,
+};
 
 volatile uint8_t
-MotorsController::dynamic_min_pwms[MOTORS_NUMBER];
+MotorsController::traction_flags[MOTORS_NUMBER];
 
-volatile float
-MotorsController::m[MOTORS_NUMBER];
+uint32_t
+MotorsController::traction_counters[MOTORS_NUMBER];
 
-volatile float
-MotorsController::q[MOTORS_NUMBER];
+uint16_t
+MotorsController::stall_ticks[MOTORS_NUMBER];
+
+volatile uint16_t
+MotorsController::tick_rate = CONTROL_TICK_DEFAULT_RATE;
+
+volatile systime_t
+MotorsController::tick_period =
+  CH_CFG_ST_FREQUENCY / CONTROL_TICK_DEFAULT_RATE;
+
+volatile uint16_t
+MotorsController::tick_overruns;
+
+volatile uint8_t
+MotorsController::store_action = STORE_NONE;
+
+volatile VehicleVelocity
+MotorsController::velocity;
+
+volatile uint8_t
+MotorsController::velocity_sequence;
+
+volatile uint8_t
+MotorsController::stop_lock_mask;
+
+MotionSegment
+MotorsController::segments[MOTION_QUEUE_LEN];
+
+volatile uint8_t
+MotorsController::segments_head;
+
+volatile uint8_t
+MotorsController::segments_tail;
+
+volatile uint8_t
+MotorsController::segments_overflows;
+
+volatile bool
+MotorsController::segments_flush;
+
+MotionSegment
+MotorsController::active_segment;
+
+volatile bool
+MotorsController::segment_active;
+
+volatile uint8_t
+MotorsController::segment_number;
+
+volatile uint16_t
+MotorsController::segment_remaining;
+
+uint32_t
+MotorsController::segment_counters[MOTORS_NUMBER];
+
+volatile uint8_t
+MotorsController::position_mask;
+
+volatile uint8_t
+MotorsController::position_flags[MOTORS_NUMBER];
+
+volatile uint32_t
+MotorsController::position_targets[MOTORS_NUMBER];
+
+volatile uint16_t
+MotorsController::position_max_speeds[MOTORS_NUMBER];
+
+volatile uint16_t
+MotorsController::position_accelerations[MOTORS_NUMBER];
+
+uint32_t
+MotorsController::position_speeds[MOTORS_NUMBER];
+
+volatile int32_t
+MotorsController::position_remaining[MOTORS_NUMBER];
 
 MotorsController::MotorsController(void) {
   motorscontroller = this;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    linkage[i] = motorslinkage[i];
+  load_calibration();
   twi_runtime_handler_init(motor);
   twi_initialise((uint8_t)SLAVE_ADDRESS, (uint8_t)GENERAL_CALL_ADDRESS_TRUE);
 }
 
+#define eeprom_load(field, stored) \
+  eeprom_read_block((void *)&(field), &(stored), sizeof(field))
+#define eeprom_store(field, stored) \
+  eeprom_update_block((const void *)&(field), &(stored), sizeof(field))
+
+// The fields are copied one by one between the EEPROM and the live
+// parameters, without a copy of the whole record on the stack.
+// A valid record marks all the motors as calibrated.
+bool
+MotorsController::load_calibration(void) {
+  if (!calibrationValid())
+    return false;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    for (uint8_t d = 0; d < DIRECTIONS; d++) {
+      MotorCalibrationData &data = calibration_record.motors[i][d];
+      eeprom_load(min_periods[i][d], data.min_period);
+      eeprom_load(static_max_periods[i][d], data.static_max_period);
+      eeprom_load(dynamic_max_periods[i][d], data.dynamic_max_period);
+      eeprom_load(static_min_pwms[i][d], data.static_min_pwm);
+      eeprom_load(dynamic_min_pwms[i][d], data.dynamic_min_pwm);
+      eeprom_load(m[i][d], data.m);
+      eeprom_load(q[i][d], data.q);
+      eeprom_load(pwm_table_pwms[i][d], data.table_pwms);
+      eeprom_load(pwm_table_periods[i][d], data.table_periods);
+    }
+    calibrations[i].step = CALIBRATE_DONE;
+  }
+  eeprom_load(pwm_table_mask, calibration_record.pwm_table_mask);
+  return true;
+}
+
+// Only a complete calibration is saved, or the record would be sealed
+// around zeros or half measured values.
+// Writing the whole record takes about a second, during which the
+// control tick stops, so it is refused unless the vehicle is at rest:
+// no drive mode running and every motor idle.
+bool
+MotorsController::save_calibration(void) {
+  chSysLock();
+  DriveModeHandler handler = drive_mode_handler;
+  chSysUnlock();
+  if (handler)
+    return false;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    if ((calibrations[i].step != CALIBRATE_DONE) ||
+        (MotorsDriver::motorsdriver->getState(i) != IDLE))
+      return false;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    for (uint8_t d = 0; d < DIRECTIONS; d++) {
+      MotorCalibrationData &data = calibration_record.motors[i][d];
+      eeprom_store(min_periods[i][d], data.min_period);
+      eeprom_store(static_max_periods[i][d], data.static_max_period);
+      eeprom_store(dynamic_max_periods[i][d], data.dynamic_max_period);
+      eeprom_store(static_min_pwms[i][d], data.static_min_pwm);
+      eeprom_store(dynamic_min_pwms[i][d], data.dynamic_min_pwm);
+      eeprom_store(m[i][d], data.m);
+      eeprom_store(q[i][d], data.q);
+      eeprom_store(pwm_table_pwms[i][d], data.table_pwms);
+      eeprom_store(pwm_table_periods[i][d], data.table_periods);
+    }
+  eeprom_store(pwm_table_mask, calibration_record.pwm_table_mask);
+  calibrationSeal();
+  return true;
+}
+
+// Invoked by the motor thread, since writing the EEPROM takes long.
+void
+MotorsController::store(uint8_t action) {
+  switch (action) {
+    case STORE_SAVE_CALIBRATION: {
+      save_calibration();
+    } break;
+    case STORE_LOAD_CALIBRATION: {
+      load_calibration();
+    } break;
+    case STORE_INVALIDATE_CALIBRATION: {
+      calibrationInvalidate();
+    } break;
+  }
+}
+
+// Product of the speed of a wheel, in mm/s, and its tacho period.
+#define WHEEL_SPEED_PERIOD \
+  ((uint32_t)(CH_CFG_ST_FREQUENCY * 2 * 3.14159265 * WHEEL_RADIUS_MM / \
+              TACHO_EDGES_PER_REVOLUTION))
+
+// Wheels too slow for the period to be represented are stopped.
+packed_period_t
+MotorsController::wheel_period(int32_t speed) {
+  uint32_t magnitude = (speed < 0) ? -speed : speed;
+  if (magnitude == 0)
+    return 0;
+  uint32_t period = WHEEL_SPEED_PERIOD / magnitude;
+  if ((period == 0) || (period > PACKED_PERIOD_MASK))
+    return 0;
+  return period | ((speed < 0) ? PACKED_PERIOD_DIRECTION_MASK : 0);
+}
+
+// Invoked from the TWI ISR: the conversion to periods is left to the
+// motor thread, which also switches to the velocity drive mode.
+void
+MotorsController::set_velocity(int16_t linear, int16_t yaw) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  velocity.linear = linear;
+  velocity.yaw = yaw;
+  velocity_sequence++;
+  if (drive_mode_handler != drive_velocity) {
+    drive_mode_handler = drive_velocity;
+    drive_step = DRIVE_INIT;
+  }
+  chSysRestoreStatusX(sts);
+}
+
+// Invoked from the TWI ISR. A full queue refuses the segment.
+void
+MotorsController::enqueue_segment(const MotionSegment &segment) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  if ((uint8_t)(segments_head - segments_tail) >= MOTION_QUEUE_LEN) {
+    segments_overflows++;
+  } else {
+    segments[segments_head & MOTION_QUEUE_MASK] = segment;
+    segments_head++;
+    if (drive_mode_handler != drive_segments) {
+      drive_mode_handler = drive_segments;
+      drive_step = DRIVE_INIT;
+    }
+  }
+  chSysRestoreStatusX(sts);
+}
+
+// The active segment is terminated by the motor thread, idling its
+// motors.
+void
+MotorsController::flush_segments(void) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  segments_tail = segments_head;
+  segments_flush = true;
+  chSysRestoreStatusX(sts);
+}
+
+// Invoked from the TWI ISR. The target is relative to the current count,
+// and the profile restarts from zero speed. Motors not in the mask keep
+// their moves.
+void
+MotorsController::set_position(const MotionPosition &position) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  if (drive_mode_handler != drive_positions) {
+    drive_mode_handler = drive_positions;
+    drive_step = DRIVE_INIT;
+    position_mask = 0;
+  }
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    if (!(position.mask & _BV(i)))
+      continue;
+    position_flags[i] = position.flags;
+    position_targets[i] = TachoMotors::tachomotors->motors[i].getCounter() +
+                          position.distance;
+    position_max_speeds[i] = position.max_speed;
+    position_accelerations[i] = position.acceleration;
+    position_speeds[i] = 0;
+    stop_lock_mask &= ~_BV(i);
+    if (position.distance && position.max_speed && position.acceleration)
+      position_mask |= _BV(i);
+    else
+      position_mask &= ~_BV(i);
+  }
+  chSysRestoreStatusX(sts);
+}
+
+void
+MotorsController::get_position_status(PositionStatus &status) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  status.mask = position_mask;
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    status.remaining[i] = position_remaining[i];
+  chSysRestoreStatusX(sts);
+}
+
+void
+MotorsController::get_queue_status(MotionQueueStatus &status) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  status.depth = segments_head - segments_tail;
+  status.active = segment_active;
+  status.number = segment_number;
+  status.remaining = segment_remaining;
+  status.overflows = segments_overflows;
+  chSysRestoreStatusX(sts);
+}
+
+// Out of range rates are ignored.
+void
+MotorsController::set_tick_rate(uint16_t rate) {
+  if ((rate < CONTROL_TICK_MIN_RATE) || (rate > CONTROL_TICK_MAX_RATE))
+    return;
+  tick_rate = rate;
+  tick_period = CH_CFG_ST_FREQUENCY / rate;
+  // The observers count in control ticks.
+  TachoMotors::tachomotors->resetObservers();
+}
+
+uint16_t
+MotorsController::ms_to_ticks(uint16_t ms) {
+  return ((uint32_t)ms * tick_rate) / 1000;
+}
+
 void
 MotorsController::set_all_raw(uint8_t pwm, uint8_t state) {
   for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
@@ -383,15 +1558,70 @@ MotorsController::set_motor_raw(uint8_t motor, uint8_t pwm, uint8_t state) {
     MotorsDriver::motorsdriver->setState(motor, (MotorStates)state);
 }
 
+void
+MotorsController::stage_motor_raw(uint8_t motor, uint8_t pwm, uint8_t state) {
+    MotorsDriver::motorsdriver->stagePWM(motor, pwm);
+    MotorsDriver::motorsdriver->stageState(motor, (MotorStates)state);
+}
+
+// The new values are applied together, at the next PWM cycles.
+void
+MotorsController::set_motors_raw(uint8_t mask,
+                                 const MotorRawSetting settings[MOTORS_NUMBER]) {
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    if (mask & _BV(i))
+      stage_motor_raw(i, settings[i].pwm, settings[i].state);
+  MotorsDriver::motorsdriver->commit();
+}
+
+// Direction of the calibration data to read back: forward, unless the
+// master has written a direction before the repeated start.
+static uint8_t
+twi_direction(void) {
+  if (twi_motor.twi_buffer.data_counter <
+      1 + sizeof(twi_motor.twi_motor_buffer.value.direction))
+    return DIRECTION_FORWARD;
+  return get_packed_direction_index(
+    twi_motor.twi_motor_buffer.value.direction);
+}
+
+// Converts a quantity of the observer, in fixed point per control tick
+// raised to the given power, to an integer per second, saturated.
+static int16_t
+observed_per_second(int32_t value, uint8_t power) {
+  int32_t rate = MotorsController::tick_rate;
+  int32_t limit = (int32_t)0x7FFFFFFF / rate;
+  for (uint8_t i = 0; i < power; i++)
+    if (value > limit)
+      value = limit * rate;
+    else if (value < -limit)
+      value = -limit * rate;
+    else
+      value *= rate;
+  return value >> OBSERVER_STATE_SHIFT;
+}
+
 uint8_t
 twi_motor_handler(uint8_t mode) {
   switch (mode) {
     case TWI_HANDLER_WRITE: {
       switch (get_parm_field(twi_motor.twi_motor_buffer.reg)) {
         case TWI_motor_PWM: {
-          MotorsDriver::motorsdriver->setPWM(
+          MotorsDriver::motorsdriver->rampPWM(
             (Motors)get_item_field(twi_motor.twi_motor_buffer.reg),
-            twi_motor.twi_motor_buffer.value.pwm);
+            twi_motor.twi_motor_buffer.value.pwm,
+            MotorsDriver::default_ramp_rate);
+        } break;
+        case TWI_motor_PWM_HIRES: {
+          MotorsDriver::motorsdriver->setHiresPWM(
+            (Motors)get_item_field(twi_motor.twi_motor_buffer.reg),
+            twi_motor.twi_motor_buffer.value.pwm_hires);
+        } break;
+        case TWI_motor_RAMP: {
+          MotorsDriver::motorsdriver->rampPWM(
+            (Motors)get_item_field(twi_motor.twi_motor_buffer.reg),
+            twi_motor.twi_motor_buffer.value.ramp.target,
+            twi_motor.twi_motor_buffer.value.ramp.rate);
         } break;
         case TWI_motor_STATE: {
           MotorsDriver::motorsdriver->setState(
@@ -399,14 +1629,85 @@ twi_motor_handler(uint8_t mode) {
             (MotorStates)twi_motor.twi_motor_buffer.value.state);
         } break;
         case TWI_motor_TACHO_COUNT: {
-          TachoMotors::tachomotors->motors[
-            get_item_field(twi_motor.twi_motor_buffer.reg)].resetCounter();
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor < MOTORS_NUMBER)
+            TachoMotors::tachomotors->motors[motor].resetCounter();
         } break;
         case TWI_motor_TACHO_AVG_PERIOD: {
-          MotorsController::target_periods[
-            get_item_field(twi_motor.twi_motor_buffer.reg)] =
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor < MOTORS_NUMBER)
+            MotorsController::target_periods[motor] =
               twi_motor.twi_motor_buffer.value.tacho_avg_period;
         } break;
+        case TWI_motor_BLOCK: {
+          // Invoked at the STOP condition, with interrupts disabled:
+          // all the motors are updated together.
+          MotorsController::motorscontroller->set_motors_raw(
+            twi_motor.twi_motor_buffer.value.block.mask,
+            twi_motor.twi_motor_buffer.value.block.motors);
+        } break;
+        case TWI_motor_MOTION: {
+          switch (get_item_field(twi_motor.twi_motor_buffer.reg)) {
+            case MOTION_VELOCITY: {
+              MotorsController::motorscontroller->set_velocity(
+                twi_motor.twi_motor_buffer.value.velocity.linear,
+                twi_motor.twi_motor_buffer.value.velocity.yaw);
+            } break;
+            case MOTION_SEGMENT: {
+              MotorsController::motorscontroller->enqueue_segment(
+                twi_motor.twi_motor_buffer.value.segment);
+            } break;
+            case MOTION_FLUSH: {
+              MotorsController::motorscontroller->flush_segments();
+            } break;
+            case MOTION_POSITION: {
+              MotorsController::motorscontroller->set_position(
+                twi_motor.twi_motor_buffer.value.position);
+            } break;
+          }
+        } break;
+        case TWI_motor_CONFIG: {
+          uint8_t index = twi_motor.twi_motor_buffer.value.config.index;
+          uint16_t value = twi_motor.twi_motor_buffer.value.config.value;
+          switch (get_item_field(twi_motor.twi_motor_buffer.reg)) {
+            case CONFIG_TICK_RATE: {
+              MotorsController::set_tick_rate(value);
+            } break;
+            case CONFIG_TICK_OVERRUNS: {
+              MotorsController::tick_overruns = 0;
+            } break;
+            case CONFIG_CRUISE_KP: {
+              MotorsController::cruise_kp = value;
+            } break;
+            case CONFIG_CRUISE_KI: {
+              MotorsController::cruise_ki = value;
+            } break;
+            case CONFIG_SYNC_KP: {
+              MotorsController::sync_kp = value;
+            } break;
+            case CONFIG_TRACTION: {
+              if (index < TRACTION_PARAMETERS)
+                MotorsController::traction_parameters[index] = value;
+            } break;
+            case CONFIG_TACHO_TIMEOUT: {
+              TachoMotors::tachomotors->setTimeout(value);
+            } break;
+            case CONFIG_OBSERVER: {
+              if ((index < OBSERVER_GAINS) && (value <= OBSERVER_MAX_GAIN))
+                TachoMotors::observer_gains[index] = value;
+            } break;
+            case CONFIG_TACHO_WINDOW: {
+              if (index < MOTORS_NUMBER)
+                TachoMotors::tachomotors->motors[index].setWindow(value);
+            } break;
+            case CONFIG_PWM_RAMP_RATE: {
+              MotorsDriver::default_ramp_rate = value;
+            } break;
+            case CONFIG_PWM_PHASE: {
+              MotorsDriver::motorsdriver->setPhase(value);
+            } break;
+          }
+        } break;
         case TWI_motor_SET_ACTION: {
           switch(twi_motor.twi_motor_buffer.value.command) {
             MotorsController::motorscontroller->drive_step = DRIVE_INIT;
@@ -418,6 +1719,16 @@ twi_motor_handler(uint8_t mode) {
                 calibrate_motors;
               MotorsController::motorscontroller->drive_step = DRIVE_INIT;
             } break;
+            case CRUISE: {
+              MotorsController::motorscontroller->drive_mode_handler = cruise;
+              MotorsController::motorscontroller->drive_step = DRIVE_INIT;
+            } break;
+            case STORE_SAVE_CALIBRATION:
+            case STORE_LOAD_CALIBRATION:
+            case STORE_INVALIDATE_CALIBRATION: {
+              MotorsController::store_action =
+                twi_motor.twi_motor_buffer.value.command;
+            } break;
           }
         } break;
       }
@@ -434,31 +1745,186 @@ twi_motor_handler(uint8_t mode) {
             MotorsDriver::motorsdriver->getState(
               (Motors)get_item_field(twi_motor.twi_motor_buffer.reg));
         } return sizeof(twi_motor.twi_motor_buffer.value.state);
+        case TWI_motor_MOTION: {
+          switch (get_item_field(twi_motor.twi_motor_buffer.reg)) {
+            case MOTION_VELOCITY: {
+              twi_motor.twi_motor_buffer.value.velocity.linear =
+                MotorsController::velocity.linear;
+              twi_motor.twi_motor_buffer.value.velocity.yaw =
+                MotorsController::velocity.yaw;
+            } return sizeof(twi_motor.twi_motor_buffer.value.velocity);
+            case MOTION_SEGMENT: {
+              MotorsController::motorscontroller->get_queue_status(
+                twi_motor.twi_motor_buffer.value.queue);
+            } return sizeof(twi_motor.twi_motor_buffer.value.queue);
+            case MOTION_POSITION: {
+              MotorsController::motorscontroller->get_position_status(
+                twi_motor.twi_motor_buffer.value.position_status);
+            } return sizeof(twi_motor.twi_motor_buffer.value.position_status);
+          }
+        } return 0;
+        case TWI_motor_STATUS: {
+          // A single motor, or all of them.
+          uint8_t start_motor;
+          uint8_t end_motor;
+          motors_range(get_item_field(twi_motor.twi_motor_buffer.reg),
+                       start_motor, end_motor);
+          for (uint8_t i = start_motor; i < end_motor; i++) {
+            MotorStatus &status =
+              twi_motor.twi_motor_buffer.value.status[i - start_motor];
+            MotorCalibration &calibration =
+              MotorsController::motorscontroller->calibrations[i];
+            status.calibration_step = calibration.step;
+            status.calibration_low = calibration.low;
+            status.calibration_high = calibration.high;
+            status.calibration_direction = calibration.direction;
+            status.traction = MotorsController::traction_flags[i];
+          }
+          return (end_motor - start_motor) * sizeof(MotorStatus);
+        }
+        case TWI_motor_PWM_HIRES: {
+          twi_motor.twi_motor_buffer.value.pwm_hires =
+            MotorsDriver::motorsdriver->getHiresPWM(
+              (Motors)get_item_field(twi_motor.twi_motor_buffer.reg));
+        } return sizeof(twi_motor.twi_motor_buffer.value.pwm_hires);
+        case TWI_motor_RAMP: {
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor >= MOTORS_NUMBER)
+            return 0;
+          twi_motor.twi_motor_buffer.value.ramp.target =
+            MotorsDriver::motorsdriver->getRampTarget(motor);
+          twi_motor.twi_motor_buffer.value.ramp.rate =
+            MotorsDriver::motorsdriver->getRampRate(motor);
+        } return sizeof(twi_motor.twi_motor_buffer.value.ramp);
         case TWI_motor_TACHO_CALIB_PERIOD: {
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor >= MOTORS_NUMBER)
+            return 0;
           twi_motor.twi_motor_buffer.value.tacho_calib_period =
-            MotorsController::motorscontroller->min_periods[
-              get_item_field(twi_motor.twi_motor_buffer.reg)];
+            MotorsController::motorscontroller->min_periods[motor][
+              twi_direction()];
         } return sizeof(twi_motor.twi_motor_buffer.value.tacho_calib_period);
         case TWI_motor_TACHO_AVG_PERIOD: {
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor >= MOTORS_NUMBER)
+            return 0;
+          TachoSnapshot tacho;
+          TachoMotors::tachomotors->getSnapshot(motor, tacho);
           twi_motor.twi_motor_buffer.value.tacho_avg_period =
-            TachoMotors::tachomotors->motors[
-              get_item_field(twi_motor.twi_motor_buffer.reg)].getAvgPeriod();
+            tacho.avg_period;
         } return sizeof(twi_motor.twi_motor_buffer.value.tacho_avg_period);
         case TWI_motor_TACHO_COUNT: {
-          twi_motor.twi_motor_buffer.value.tacho_count =
-            TachoMotors::tachomotors->motors[
-              get_item_field(twi_motor.twi_motor_buffer.reg)].getCounter();
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor >= MOTORS_NUMBER)
+            return 0;
+          TachoSnapshot tacho;
+          TachoMotors::tachomotors->getSnapshot(motor, tacho);
+          twi_motor.twi_motor_buffer.value.tacho_count = tacho.counter;
         } return sizeof(twi_motor.twi_motor_buffer.value.tacho_count);
         case TWI_motor_PWM_M: {
-          twi_motor.twi_motor_buffer.value.m =
-            MotorsController::motorscontroller->m[
-              get_item_field(twi_motor.twi_motor_buffer.reg)];
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor >= MOTORS_NUMBER)
+            return 0;
+          fixed_t m =
+            MotorsController::motorscontroller->m[motor][twi_direction()];
+          twi_motor.twi_motor_buffer.value.m.fixed = m;
+          twi_motor.twi_motor_buffer.value.m.real = fixed_to_float(m);
         } return sizeof(twi_motor.twi_motor_buffer.value.m);
         case TWI_motor_PWM_Q: {
-          twi_motor.twi_motor_buffer.value.q =
-            MotorsController::motorscontroller->q[
-              get_item_field(twi_motor.twi_motor_buffer.reg)];
+          uint8_t motor = get_item_field(twi_motor.twi_motor_buffer.reg);
+          if (motor >= MOTORS_NUMBER)
+            return 0;
+          fixed_t q =
+            MotorsController::motorscontroller->q[motor][twi_direction()];
+          twi_motor.twi_motor_buffer.value.q.fixed = q;
+          twi_motor.twi_motor_buffer.value.q.real = fixed_to_float(q);
         } return sizeof(twi_motor.twi_motor_buffer.value.q);
+        case TWI_motor_CONFIG: {
+          uint8_t index = twi_motor.twi_motor_buffer.value.config.index;
+          uint16_t value = 0;
+          switch (get_item_field(twi_motor.twi_motor_buffer.reg)) {
+            case CONFIG_TICK_RATE: {
+              value = MotorsController::tick_rate;
+            } break;
+            case CONFIG_TICK_OVERRUNS: {
+              value = MotorsController::tick_overruns;
+            } break;
+            case CONFIG_CRUISE_KP: {
+              value = MotorsController::cruise_kp;
+            } break;
+            case CONFIG_CRUISE_KI: {
+              value = MotorsController::cruise_ki;
+            } break;
+            case CONFIG_SYNC_KP: {
+              value = MotorsController::sync_kp;
+            } break;
+            case CONFIG_TRACTION: {
+              if (index < TRACTION_PARAMETERS)
+                value = MotorsController::traction_parameters[index];
+            } break;
+            case CONFIG_TACHO_TIMEOUT: {
+              value = TachoMotors::tachomotors->getTimeout();
+            } break;
+            case CONFIG_OBSERVER: {
+              if (index < OBSERVER_GAINS)
+                value = TachoMotors::observer_gains[index];
+            } break;
+            case CONFIG_STACK_FREE: {
+              value = motor_thread_stack_free();
+            } break;
+            case CONFIG_TACHO_WINDOW: {
+              if (index < MOTORS_NUMBER)
+                value = TachoMotors::tachomotors->motors[index].getWindow();
+            } break;
+            case CONFIG_PWM_RAMP_RATE: {
+              value = MotorsDriver::default_ramp_rate;
+            } break;
+            case CONFIG_PWM_PHASE: {
+              value = MotorsDriver::motorsdriver->getPhase();
+            } break;
+            case CONFIG_PWM_FREQUENCY: {
+              value = PWM_FREQUENCY;
+            } break;
+            case CONFIG_PWM_TABLE_PWM:
+            case CONFIG_PWM_TABLE_PERIOD: {
+              uint8_t motor = get_pwm_table_motor(index);
+              uint8_t d = get_pwm_table_direction(index);
+              uint8_t point = get_pwm_table_point(index);
+              if (motor >= MOTORS_NUMBER)
+                break;
+              if (get_item_field(twi_motor.twi_motor_buffer.reg) ==
+                  CONFIG_PWM_TABLE_PWM)
+                value = MotorsController::pwm_table_pwms[motor][d][point];
+              else
+                value = MotorsController::pwm_table_periods[motor][d][point];
+            } break;
+          }
+          twi_motor.twi_motor_buffer.value.config.value = value;
+        } return sizeof(twi_motor.twi_motor_buffer.value.config);
+        case TWI_motor_TELEMETRY: {
+          // All the motors in one read. The item field is ignored.
+          // The snapshots are taken together, against the same time.
+          // They are static, to keep them off the interrupted stack.
+          static TachoSnapshot tachos[MOTORS_NUMBER];
+          TachoMotors::tachomotors->getSnapshots(tachos);
+          for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+            MotorTelemetry &telemetry =
+              twi_motor.twi_motor_buffer.value.telemetry[i];
+            telemetry.pwm = MotorsDriver::motorsdriver->getPWM(i);
+            telemetry.state = MotorsDriver::motorsdriver->getState(i);
+            telemetry.tacho_count = tachos[i].counter;
+            telemetry.tacho_avg_period = tachos[i].avg_period;
+            telemetry.target_period =
+              MotorsController::motorscontroller->target_periods[i];
+            int32_t speed;
+            int32_t acceleration;
+            TachoMotors::tachomotors->motors[i].getObserved(speed,
+                                                             acceleration);
+            telemetry.observed_speed = observed_per_second(speed, 1);
+            telemetry.observed_acceleration =
+              observed_per_second(acceleration, 2);
+          }
+        } return sizeof(twi_motor.twi_motor_buffer.value.telemetry);
       }
     } return 0;
   }
@@ -466,6 +1932,7 @@ twi_motor_handler(uint8_t mode) {
 }
 
 void createMotorThread(void) {
+  motor_thread_stack_fill();
   chThdCreateStatic(waThreadMotor, sizeof(waThreadMotor), NORMALPRIO,
                     ThreadMotor, NULL);
 }
@@ -32,18 +32,33 @@ extern "C" {
 // The MSb is the direction, the remaining 15 bits are the real period.
 typedef uint16_t packed_period_t;
 
-typedef struct {
-  volatile uint8_t *pwm_ddr_address;
-  volatile uint8_t pwm_pin_bit_mask;
-  volatile uint8_t *pwm_counter_address;
-  volatile uint8_t *pwm_control_register_address;
-  volatile uint8_t pwm_compare_output_mode_mask;
-  volatile uint8_t pwm_wgm_cs_mask;
-  volatile uint8_t *dir_ddr_address;
-  volatile uint8_t *dir_pin_address;
-  volatile uint8_t dir_forward_bit_mask;
-  volatile uint8_t dir_backward_bit_mask;
-} MotorData;
+#define PACKED_PERIOD_DIRECTION_MASK 0x8000
+#define PACKED_PERIOD_MASK 0x7FFF
+#define get_packed_period(packed) ((packed) & PACKED_PERIOD_MASK)
+#define get_packed_direction(packed) \
+  (((packed) & PACKED_PERIOD_DIRECTION_MASK) ? BACKWARD : FORWARD)
+
+// The calibration data is kept separately for each direction.
+typedef enum {
+  DIRECTION_FORWARD = 0,
+  DIRECTION_BACKWARD,
+  DIRECTIONS,
+} Directions;
+
+#define get_packed_direction_index(packed) \
+  (((packed) & PACKED_PERIOD_DIRECTION_MASK) ? \
+   DIRECTION_BACKWARD : DIRECTION_FORWARD)
+#define calibration_bit(motor, direction) \
+  _BV((motor) * DIRECTIONS + (direction))
+
+// Signed fixed point, Q16.16, for the PWM vs period linear model.
+typedef int32_t fixed_t;
+
+#define FIXED_SHIFT 16
+#define int_to_fixed(x) ((fixed_t)(x) << FIXED_SHIFT)
+#define fixed_to_int(x) \
+  ((int16_t)(((x) + ((fixed_t)1 << (FIXED_SHIFT - 1))) >> FIXED_SHIFT))
+#define fixed_to_float(x) ((float)(x) / (float)((fixed_t)1 << FIXED_SHIFT))
 
 TWI_CREATE_COMMANDS(motor, 1,
   PWM,                 // 01
@@ -54,18 +69,219 @@ TWI_CREATE_COMMANDS(motor, 1,
   TACHO_COUNT,         // 06
   PWM_M,               // 07
   PWM_Q,               // 08
+  CONFIG,              // 09
+  TELEMETRY,           // 10
+  BLOCK,               // 11
+  RAMP,                // 12
+  PWM_HIRES,           // 13
+  STATUS,              // 14
+  MOTION               // 15
 );
 
+// Parameters accessible through the CONFIG register, selected by the
+// item field. The index is used only by per-motor parameters.
+typedef enum {
+  CONFIG_TICK_RATE = 0,
+  CONFIG_TICK_OVERRUNS,
+  CONFIG_CRUISE_KP,
+  CONFIG_CRUISE_KI,
+  CONFIG_TACHO_WINDOW,
+  CONFIG_PWM_RAMP_RATE,
+  CONFIG_PWM_PHASE,
+  CONFIG_PWM_FREQUENCY,
+  CONFIG_PWM_TABLE_PWM,
+  CONFIG_PWM_TABLE_PERIOD,
+  CONFIG_SYNC_KP,
+  CONFIG_TRACTION,
+  CONFIG_TACHO_TIMEOUT,
+  CONFIG_OBSERVER,
+  CONFIG_STACK_FREE,
+  CONFIG_PARAMETERS,
+} ConfigParameters;
+
+// Thresholds of the slip and stall detector, selected by the index of
+// CONFIG_TRACTION. Ratios are in 1/256: a motor slips when its partner's
+// period is longer than its own by more than the slip ratio, and a
+// flagged motor gets its PWM scaled by the reduction, 256 meaning none.
+typedef enum {
+  TRACTION_SLIP_RATIO = 0,
+  TRACTION_STALL_PWM,
+  TRACTION_STALL_TIME,
+  TRACTION_REDUCTION,
+  TRACTION_PARAMETERS,
+} TractionParameters;
+
+typedef enum {
+  TRACTION_SLIP = _BV(0),
+  TRACTION_STALL = _BV(1),
+} TractionFlags;
+
+// Points of the PWM vs period table of each motor, sampled by the
+// calibration between the dynamic minimum PWM and MAX_PWM.
+typedef enum {
+  PWM_TABLE_POINTS = 8,
+} PWMTableSize;
+
+// Index of a point of the table, for the CONFIG register: the motor in
+// the upper nibble, then the direction bit and the point in 3 bits.
+#define pwm_table_index(motor, direction, point) \
+  (((motor) << 4) | ((direction) << 3) | (point))
+#define get_pwm_table_motor(index) ((index) >> 4)
+#define get_pwm_table_direction(index) (((index) >> 3) & 0x01)
+#define get_pwm_table_point(index) ((index) & 0x07)
+
+// State of one motor, as returned by the TELEMETRY register.
+// The observed speed and acceleration are in edges/s and edges/s^2.
+typedef struct {
+  uint8_t pwm;
+  uint8_t state;
+  uint32_t tacho_count;
+  systime_t tacho_avg_period;
+  packed_period_t target_period;
+  int16_t observed_speed;
+  int16_t observed_acceleration;
+} __attribute__((__packed__)) MotorTelemetry;
+
+// Progress of one motor, as returned by the STATUS register.
+// While calibrating, the minimum PWM lies in (low, high].
+typedef struct {
+  uint8_t calibration_step;
+  uint8_t calibration_low;
+  uint8_t calibration_high;
+  uint8_t calibration_direction;
+  uint8_t traction;
+} __attribute__((__packed__)) MotorStatus;
+
+// Vehicle level commands of the MOTION register, selected by the item
+// field.
+typedef enum {
+  MOTION_VELOCITY = 0,
+  MOTION_SEGMENT,
+  MOTION_FLUSH,
+  MOTION_POSITION,
+  MOTION_COMMANDS,
+} MotionCommands;
+
+// Linear velocity in mm/s and yaw rate in mrad/s, counterclockwise.
+typedef struct {
+  int16_t linear;
+  int16_t yaw;
+} __attribute__((__packed__)) VehicleVelocity;
+
+// A vehicle segment commands a velocity, otherwise the segment commands
+// a period to the motors in its mask. The length is in ms or, for a
+// distance, in tacho edges averaged over the motors involved.
+// At its end, the motors either keep their targets, for the next
+// segment, or are stopped, idle or locked.
+typedef enum {
+  SEGMENT_VEHICLE = _BV(0),
+  SEGMENT_DISTANCE = _BV(1),
+  SEGMENT_END_MASK = _BV(3) | _BV(2),
+  SEGMENT_END_CONTINUE = 0,
+  SEGMENT_END_IDLE = _BV(2),
+  SEGMENT_END_LOCK = _BV(3),
+} SegmentFlags;
+
+typedef struct {
+  uint8_t flags;
+  uint8_t mask;
+  union {
+    VehicleVelocity velocity;
+    packed_period_t period;
+  } __attribute__((__packed__)) target;
+  uint16_t length;
+} __attribute__((__packed__)) MotionSegment;
+
+typedef enum {
+  MOTION_QUEUE_SHIFT = 3,
+  MOTION_QUEUE_LEN = 1 << MOTION_QUEUE_SHIFT,
+  MOTION_QUEUE_MASK = MOTION_QUEUE_LEN - 1,
+} MotionQueueSize;
+
+// Segments waiting, number of the active one since the start of the
+// drive mode (0 if none is active yet), what remains of it, in control
+// ticks or tacho edges, and segments refused because of a full queue.
+typedef struct {
+  uint8_t depth;
+  uint8_t active;
+  uint8_t number;
+  uint16_t remaining;
+  uint8_t overflows;
+} __attribute__((__packed__)) MotionQueueStatus;
+
+// Moves the motors in the mask by a number of tacho edges, with a
+// trapezoidal profile: the speed, in edges/s, ramps up at the given
+// acceleration, in edges/s^2, up to the given maximum, then down so as
+// to reach zero on target. The motors are then idled or locked.
+typedef enum {
+  POSITION_BACKWARD = _BV(0),
+  POSITION_LOCK = _BV(1),
+} PositionFlags;
+
+typedef struct {
+  uint8_t mask;
+  uint8_t flags;
+  uint32_t distance;
+  uint16_t max_speed;
+  uint16_t acceleration;
+} __attribute__((__packed__)) MotionPosition;
+
+// Motors still moving and edges left to each target, negative if the
+// target was overshot.
+typedef struct {
+  uint8_t mask;
+  int32_t remaining[MOTORS_NUMBER];
+} __attribute__((__packed__)) PositionStatus;
+
+// PWM and state of one motor, as written to the BLOCK register.
+typedef struct {
+  uint8_t pwm;
+  uint8_t state;
+} __attribute__((__packed__)) MotorRawSetting;
+
+// Only the motors with their bit set in the mask are affected.
+typedef struct {
+  uint8_t mask;
+  MotorRawSetting motors[MOTORS_NUMBER];
+} __attribute__((__packed__)) MotorsBlock;
+
 typedef union {
   uint8_t data[0];
   uint8_t pwm;
   uint8_t state;
-  uint16_t tacho_count;
+  uint32_t tacho_count;
   systime_t tacho_avg_period;
+  uint16_t pwm_hires;
+  // Optionally written before reading the calibration of a motor, to
+  // select the direction, as in packed_period_t.
+  packed_period_t direction;
   uint8_t command;
   systime_t tacho_calib_period;
-  float m;
-  float q;
+  // The float comes first, for compatibility with older masters.
+  struct {
+    float real;
+    fixed_t fixed;
+  } __attribute__((__packed__)) m;
+  struct {
+    float real;
+    fixed_t fixed;
+  } __attribute__((__packed__)) q;
+  struct {
+    uint8_t index;
+    uint16_t value;
+  } __attribute__((__packed__)) config;
+  MotorTelemetry telemetry[MOTORS_NUMBER];
+  MotorsBlock block;
+  MotorStatus status[MOTORS_NUMBER];
+  VehicleVelocity velocity;
+  MotionSegment segment;
+  MotionQueueStatus queue;
+  MotionPosition position;
+  PositionStatus position_status;
+  struct {
+    uint8_t target;
+    uint16_t rate;
+  } __attribute__((__packed__)) ramp;
 } __attribute__((__packed__)) MotorRegValue;
 
 typedef struct {
@@ -76,21 +292,97 @@ typedef struct {
 // Do not expose the class declaration when included
 // from a c file, which is anyway not interested in it.
 #ifdef __cplusplus
+
+#include "tachomotor.h"
+
+// Values staged for a later, simultaneous, update of the motors.
+// The PWM is in high resolution.
+typedef struct {
+  uint8_t pwm_mask;
+  uint8_t state_mask;
+  uint16_t pwm[MOTORS_NUMBER];
+  uint8_t state[MOTORS_NUMBER];
+} MotorsShadow;
+
+typedef enum {
+  COMMIT_IDLE = 0,
+  COMMIT_PWM,
+  COMMIT_STATE,
+} CommitPhase;
+
+// Ramp rates are in 1/2^PWM_RAMP_RATE_SHIFT of PWM step per PWM cycle,
+// which with the default clk/64 lasts 1.024ms. A rate of 0 means no ramp.
+typedef enum {
+  PWM_RAMP_RATE_SHIFT = 8,
+  PWM_RAMP_NONE = 0,
+} PWMRampRates;
+
+// High resolution PWM: the upper byte goes to the OCR, the lower byte
+// is a fraction, dithered over successive PWM cycles by a first order
+// sigma-delta modulator.
+typedef enum {
+  PWM_HIRES_SHIFT = 8,
+  PWM_HIRES_FRACTION_MASK = (1 << PWM_HIRES_SHIFT) - 1,
+} PWMHiresResolution;
+
+// Relative phase of the PWM timers: with interleaved edges TC2 runs half
+// a period after TC0, so that the two halves of the motors do not draw
+// their inrush current at the same time.
+typedef enum {
+  PWM_PHASE_ALIGNED = 0,
+  PWM_PHASE_INTERLEAVED,
+  PWM_PHASES,
+} PWMPhases;
+
+// Besides the immediate setters, PWM and state can be staged and then
+// committed, so that they are applied by the PWM overflow ISR: the OCRs
+// first, then, one PWM cycle later, when the hardware has latched the
+// new compare values, the direction pins, with one write per port.
 class MotorsDriver {
+  protected:
+    static MotorsShadow staged;
+    static MotorsShadow committing;
+    static volatile uint8_t commit_phase;
+    static volatile uint8_t ramp_mask;
+    static volatile uint8_t ramp_targets[MOTORS_NUMBER];
+    static volatile uint16_t ramp_rates[MOTORS_NUMBER];
+    static uint8_t ramp_fractions[MOTORS_NUMBER];
+    static volatile uint8_t hires_mask;
+    static volatile uint16_t hires_pwms[MOTORS_NUMBER];
+    static uint8_t dither_errors[MOTORS_NUMBER];
+    static void setHiresPWMI(uint8_t motor, uint16_t val);
+    static void commitStatesI(uint8_t mask);
+    static volatile uint8_t pwm_phase;
   public:
+    static volatile uint16_t default_ramp_rate;
     static class MotorsDriver *motorsdriver;
     MotorsDriver(void);
     void configure(uint8_t motor);
     void setPWM(uint8_t motor, uint8_t val=0);
     uint8_t getPWM(uint8_t motor);
-    void increasePWM(uint8_t motor, uint8_t delta);
-    void decreasePWM(uint8_t motor, uint8_t delta);
     void setState(uint8_t motor, MotorStates state);
     uint8_t getState(uint8_t motor);
     void idle(uint8_t motor) { setState(motor, IDLE);};
     void forward(uint8_t motor) { setState(motor, FORWARD);};
     void backward(uint8_t motor) { setState(motor, BACKWARD);};
     void lock(uint8_t motor) { setState(motor, LOCK);};
+    void setHiresPWM(uint8_t motor, uint16_t val);
+    uint16_t getHiresPWM(uint8_t motor);
+    void stagePWM(uint8_t motor, uint8_t val) {
+      stageHiresPWM(motor, (uint16_t)val << PWM_HIRES_SHIFT);
+    };
+    void stageHiresPWM(uint8_t motor, uint16_t val);
+    void stageState(uint8_t motor, MotorStates state);
+    void commit(void);
+    void setPhase(uint8_t phase);
+    uint8_t getPhase(void) {return pwm_phase;};
+    void rampPWM(uint8_t motor, uint8_t target, uint16_t rate);
+    uint8_t getRampTarget(uint8_t motor) {return ramp_targets[motor];};
+    uint16_t getRampRate(uint8_t motor) {return ramp_rates[motor];};
+    static void rampCycleI(void);
+    static void pwmCycleI(void);
+    static void timer2CycleI(void);
+    static void ditherCycleI(void);
     friend uint8_t twi_motor_handler(uint8_t mode);
 };
 
@@ -101,6 +393,15 @@ typedef enum {
   DRIVE_MODES
 } DriveMode;
 
+// Further SET_ACTION commands, run by the motor thread.
+typedef enum {
+  STORE_NONE = 0,
+  STORE_SAVE_CALIBRATION = DRIVE_MODES,
+  STORE_LOAD_CALIBRATION,
+  STORE_INVALIDATE_CALIBRATION,
+  STORE_ACTIONS,
+} StoreAction;
+
 typedef enum {
   DRIVE_NOP = 0,
   DRIVE_INIT,
@@ -108,18 +409,50 @@ typedef enum {
   DRIVE_STEPS,
 } DriveStep;
 
+// Each motor goes through the calibration on its own, forward and then
+// backward. For each direction, first the
+// minimum period at full PWM, then the bisection of the minimum PWM
+// that keeps it spinning, the sampling of the PWM vs period table and
+// the bisection of the minimum PWM that starts it from standstill.
 typedef enum {
-  CALIBRATE_STATIC_MIN_PWM_INIT = DRIVE_INIT,
-  CALIBRATE_STATIC_MIN_PWM_RAMP_UP,
-  CALIBRATE_STATIC_MIN_PWM_MEASURE,
-  CALIBRATE_MIN_PERIOD_RAMP_UP,
+  CALIBRATE_NONE = 0,
+  CALIBRATE_MIN_PERIOD_SPIN_UP,
   CALIBRATE_MIN_PERIOD_MEASURE,
-  CALIBRATE_DYNAMIC_MIN_PWM_RAMP_DOWN,
-  CALIBRATE_DYNAMIC_MIN_PWM_MEASURE,
+  CALIBRATE_DYNAMIC_MIN_PWM_KICK,
+  CALIBRATE_DYNAMIC_MIN_PWM_SETTLE,
+  CALIBRATE_DYNAMIC_MIN_PWM_PROBE,
+  CALIBRATE_PWM_TABLE_SETTLE,
+  CALIBRATE_PWM_TABLE_MEASURE,
+  CALIBRATE_STATIC_MIN_PWM_STOP,
+  CALIBRATE_STATIC_MIN_PWM_PROBE,
+  CALIBRATE_DONE,
   CALIBRATE_STEPS,
 } CalibrateStep;
 
-typedef uint32_t (*DriveModeHandler)(void);
+// Bisection state of one motor. The measurement window starts from the
+// tacho count and the last edge seen when it opens.
+typedef struct {
+  uint8_t step;
+  uint8_t low;
+  uint8_t high;
+  uint8_t point;
+  uint8_t direction;
+  uint32_t counter;
+  hirestime_t hires_event;
+  systime_t deadline;
+} MotorCalibration;
+
+// Invoked on the control tick, returns the number of ticks to wait
+// before being invoked again (0 and 1 both mean the next tick).
+// Handlers get the tacho snapshots taken once per tick by the thread,
+// so that they don't each keep a copy on its small stack.
+typedef uint16_t (*DriveModeHandler)(const TachoSnapshot *tachos);
+
+typedef enum {
+  CONTROL_TICK_MIN_RATE = 10,
+  CONTROL_TICK_DEFAULT_RATE = 100,
+  CONTROL_TICK_MAX_RATE = 500,
+} ControlTickRates;
 
 class MotorsController {
   public:
@@ -128,27 +461,87 @@ class MotorsController {
     static class MotorsController *motorscontroller;
     static volatile packed_period_t target_periods[MOTORS_NUMBER];
     static volatile packed_period_t real_target_periods[MOTORS_NUMBER];
-    static volatile packed_period_t min_periods[MOTORS_NUMBER];
-    static volatile packed_period_t static_max_periods[MOTORS_NUMBER];
-    static volatile packed_period_t dynamic_max_periods[MOTORS_NUMBER];
-    static volatile uint8_t static_min_pwms[MOTORS_NUMBER];
-    static volatile uint8_t dynamic_min_pwms[MOTORS_NUMBER];
-    static volatile float m[MOTORS_NUMBER];
-    static volatile float q[MOTORS_NUMBER];
+    static volatile packed_period_t min_periods[MOTORS_NUMBER][DIRECTIONS];
+    static volatile packed_period_t static_max_periods[MOTORS_NUMBER][DIRECTIONS];
+    static volatile packed_period_t dynamic_max_periods[MOTORS_NUMBER][DIRECTIONS];
+    static volatile uint8_t static_min_pwms[MOTORS_NUMBER][DIRECTIONS];
+    static volatile uint8_t dynamic_min_pwms[MOTORS_NUMBER][DIRECTIONS];
+    static MotorCalibration calibrations[MOTORS_NUMBER];
+    static volatile uint8_t pwm_table_mask;
+    static volatile uint8_t
+      pwm_table_pwms[MOTORS_NUMBER][DIRECTIONS][PWM_TABLE_POINTS];
+    static volatile packed_period_t
+      pwm_table_periods[MOTORS_NUMBER][DIRECTIONS][PWM_TABLE_POINTS];
+    static volatile fixed_t m[MOTORS_NUMBER][DIRECTIONS];
+    static volatile fixed_t q[MOTORS_NUMBER][DIRECTIONS];
     static volatile Motors linkage[MOTORS_NUMBER];
+    static int32_t cruise_integrals[MOTORS_NUMBER];
+    static int16_t cruise_kp;
+    static int16_t cruise_ki;
+    static int16_t sync_kp;
+    static uint8_t sync_mask;
+    static uint32_t sync_references[MOTORS_NUMBER];
+    static uint16_t traction_parameters[TRACTION_PARAMETERS];
+    static volatile uint8_t traction_flags[MOTORS_NUMBER];
+    static uint32_t traction_counters[MOTORS_NUMBER];
+    static uint16_t stall_ticks[MOTORS_NUMBER];
+    static volatile uint16_t tick_rate;
+    static volatile systime_t tick_period;
+    static volatile uint16_t tick_overruns;
+    static volatile uint8_t store_action;
+    static volatile VehicleVelocity velocity;
+    static volatile uint8_t velocity_sequence;
+    static volatile uint8_t stop_lock_mask;
+    static MotionSegment segments[MOTION_QUEUE_LEN];
+    static volatile uint8_t segments_head;
+    static volatile uint8_t segments_tail;
+    static volatile uint8_t segments_overflows;
+    static volatile bool segments_flush;
+    static MotionSegment active_segment;
+    static volatile bool segment_active;
+    static volatile uint8_t segment_number;
+    static volatile uint16_t segment_remaining;
+    static uint32_t segment_counters[MOTORS_NUMBER];
+    static volatile uint8_t position_mask;
+    static volatile uint8_t position_flags[MOTORS_NUMBER];
+    static volatile uint32_t position_targets[MOTORS_NUMBER];
+    static volatile uint16_t position_max_speeds[MOTORS_NUMBER];
+    static volatile uint16_t position_accelerations[MOTORS_NUMBER];
+    static uint32_t position_speeds[MOTORS_NUMBER];
+    static volatile int32_t position_remaining[MOTORS_NUMBER];
     MotorsController(void);
+    bool load_calibration(void);
+    bool save_calibration(void);
+    void store(uint8_t action);
+    static void set_tick_rate(uint16_t rate);
+    static uint16_t ms_to_ticks(uint16_t ms);
     void set_all_raw(uint8_t pwm, uint8_t state);
     void set_motor_raw(uint8_t motor, uint8_t pwm, uint8_t state);
+    void stage_motor_raw(uint8_t motor, uint8_t pwm, uint8_t state);
+    void set_motors_raw(uint8_t mask,
+                        const MotorRawSetting settings[MOTORS_NUMBER]);
+    void set_velocity(int16_t linear, int16_t yaw);
+    void enqueue_segment(const MotionSegment &segment);
+    void flush_segments(void);
+    void get_queue_status(MotionQueueStatus &status);
+    void set_position(const MotionPosition &position);
+    void get_position_status(PositionStatus &status);
+    static packed_period_t wheel_period(int32_t speed);
     void set_motor_period(uint8_t motor, packed_period_t target_period) {
       target_periods[motor] = target_period;
       real_target_periods[motor] = target_period;
     };
     uint32_t control(void);
-    friend uint8_t convert(void);
+    friend uint8_t convert(uint8_t motor, packed_period_t packed_period);
     friend uint8_t twi_motor_handler(uint8_t mode);
-    friend uint32_t calibrate_motors(void);
+    friend void calibrate_motor(uint8_t motor, const TachoSnapshot &tacho,
+                                systime_t now);
+    friend uint16_t calibrate_motors(const TachoSnapshot *tachos);
     friend void calculate_parameters(void);
-    friend uint32_t cruise(void);
+    friend uint16_t cruise(const TachoSnapshot *tachos);
+    friend uint16_t drive_velocity(const TachoSnapshot *tachos);
+    friend uint16_t drive_segments(const TachoSnapshot *tachos);
+    friend uint16_t drive_positions(const TachoSnapshot *tachos);
 };
 
 void createMotorThread(void);
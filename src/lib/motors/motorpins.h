@@ -0,0 +1,208 @@
+/*
+    Car controls.
+    Copyright (C) 2015-16 Igor Stoppa <igor.stoppa@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef MOTOR_PINS_H
+#define MOTOR_PINS_H
+
+#include <avr/io.h>
+#include "motors.h"
+
+/*
+  Compile time description of the ATMega328P resources used by the
+  motors: the 8 bits timers generating the PWM, their output compare
+  channels and the GPIO ports.
+  Every register is resolved at build time, so that each operation on
+  a motor compiles to a few direct accesses.
+*/
+
+// Prescaler of both PWM timers, can be overridden at build time:
+// 64 or 256, for a PWM frequency of ~976Hz or ~244Hz.
+// TC0 is also the high resolution timebase, which follows it. Faster
+// clocks are not supported: the tacho periods are saturated to 16 bits
+// of high resolution ticks, which at clk/8 would be only ~33ms.
+#ifndef PWM_PRESCALER
+#define PWM_PRESCALER 64
+#endif
+
+#define PWM_FREQUENCY (F_CPU / PWM_PRESCALER / 256)
+
+typedef enum {
+  PWM_TIMER0 = 0,
+  PWM_TIMER2 = 2,
+} PWMTimer;
+
+typedef enum {
+  PWM_CHANNEL_A = 0,
+  PWM_CHANNEL_B = 1,
+} PWMChannel;
+
+typedef enum {
+  GPIO_PORTB = 0,
+  GPIO_PORTC,
+  GPIO_PORTD,
+  GPIO_PORTS,
+} GPIOPort;
+
+template<GPIOPort port> struct GPIO;
+
+template<> struct GPIO<GPIO_PORTB> {
+  static volatile uint8_t &ddr(void) {return DDRB;};
+  static volatile uint8_t &out(void) {return PORTB;};
+};
+
+template<> struct GPIO<GPIO_PORTC> {
+  static volatile uint8_t &ddr(void) {return DDRC;};
+  static volatile uint8_t &out(void) {return PORTC;};
+};
+
+template<> struct GPIO<GPIO_PORTD> {
+  static volatile uint8_t &ddr(void) {return DDRD;};
+  static volatile uint8_t &out(void) {return PORTD;};
+};
+
+// Both timers run in fast PWM mode, with the same prescaler.
+template<PWMTimer timer> struct PWMTimerRegs;
+
+template<> struct PWMTimerRegs<PWM_TIMER0> {
+  static volatile uint8_t &tccra(void) {return TCCR0A;};
+  static volatile uint8_t &tccrb(void) {return TCCR0B;};
+  static volatile uint8_t &tcnt(void) {return TCNT0;};
+  static constexpr uint8_t fast_pwm = _BV(WGM01) | _BV(WGM00);
+  static constexpr uint8_t clockSelect(uint16_t prescaler) {
+    return (prescaler == 64) ? (_BV(CS01) | _BV(CS00)) :
+           (prescaler == 256) ? _BV(CS02) : 0;
+  };
+};
+
+template<> struct PWMTimerRegs<PWM_TIMER2> {
+  static volatile uint8_t &tccra(void) {return TCCR2A;};
+  static volatile uint8_t &tccrb(void) {return TCCR2B;};
+  static volatile uint8_t &tcnt(void) {return TCNT2;};
+  static constexpr uint8_t fast_pwm = _BV(WGM21) | _BV(WGM20);
+  static constexpr uint8_t clockSelect(uint16_t prescaler) {
+    return (prescaler == 64) ? _BV(CS22) :
+           (prescaler == 256) ? (_BV(CS22) | _BV(CS21)) : 0;
+  };
+};
+
+static_assert(PWMTimerRegs<PWM_TIMER0>::clockSelect(PWM_PRESCALER) &&
+              PWMTimerRegs<PWM_TIMER2>::clockSelect(PWM_PRESCALER),
+              "Unsupported PWM prescaler.");
+
+// Each output compare channel drives a fixed pin.
+template<PWMTimer timer, PWMChannel channel> struct OutputCompare;
+
+template<> struct OutputCompare<PWM_TIMER0, PWM_CHANNEL_A> {
+  static volatile uint8_t &ocr(void) {return OCR0A;};
+  static constexpr uint8_t com_mask = _BV(COM0A1);
+  static constexpr GPIOPort port = GPIO_PORTD;
+  static constexpr uint8_t bit = 6;
+};
+
+template<> struct OutputCompare<PWM_TIMER0, PWM_CHANNEL_B> {
+  static volatile uint8_t &ocr(void) {return OCR0B;};
+  static constexpr uint8_t com_mask = _BV(COM0B1);
+  static constexpr GPIOPort port = GPIO_PORTD;
+  static constexpr uint8_t bit = 5;
+};
+
+template<> struct OutputCompare<PWM_TIMER2, PWM_CHANNEL_A> {
+  static volatile uint8_t &ocr(void) {return OCR2A;};
+  static constexpr uint8_t com_mask = _BV(COM2A1);
+  static constexpr GPIOPort port = GPIO_PORTB;
+  static constexpr uint8_t bit = 3;
+};
+
+template<> struct OutputCompare<PWM_TIMER2, PWM_CHANNEL_B> {
+  static volatile uint8_t &ocr(void) {return OCR2B;};
+  static constexpr uint8_t com_mask = _BV(COM2B1);
+  static constexpr GPIOPort port = GPIO_PORTD;
+  static constexpr uint8_t bit = 3;
+};
+
+// The PWM pin is stated explicitly, even if implied by timer and
+// channel, so that a wiring mismatch is caught at build time.
+// The encoding of MotorStates matches the direction bits:
+// bit 0 is backward and bit 1 is forward.
+template<PWMTimer pwm_timer, PWMChannel pwm_channel,
+         GPIOPort pwm_port, uint8_t pwm_bit,
+         GPIOPort dir_port, uint8_t forward_bit, uint8_t backward_bit>
+struct MotorWiring {
+  typedef PWMTimerRegs<pwm_timer> Timer;
+  typedef OutputCompare<pwm_timer, pwm_channel> Output;
+  typedef GPIO<dir_port> DirPins;
+  static_assert((Output::port == pwm_port) && (Output::bit == pwm_bit),
+                "The PWM pin is not the output of the timer channel.");
+  static_assert(forward_bit != backward_bit,
+                "Forward and backward must use different pins.");
+  static constexpr PWMTimer timer = pwm_timer;
+  static constexpr uint8_t output_id = (pwm_timer << 1) | pwm_channel;
+  static constexpr GPIOPort direction_port = dir_port;
+  static constexpr uint8_t direction_mask =
+    _BV(forward_bit) | _BV(backward_bit);
+  static constexpr uint8_t directionBits(uint8_t state) {
+    return ((state & FORWARD) ? _BV(forward_bit) : 0) |
+           ((state & BACKWARD) ? _BV(backward_bit) : 0);
+  };
+  static void configure(void) {
+    GPIO<pwm_port>::ddr() |= _BV(pwm_bit);
+    Timer::tccra() |= Output::com_mask | Timer::fast_pwm;
+    Timer::tccrb() |= Timer::clockSelect(PWM_PRESCALER);
+    DirPins::ddr() |= direction_mask;
+  };
+  static void setPWM(uint8_t val) {Output::ocr() = val;};
+  static uint8_t getPWM(void) {return Output::ocr();};
+  static void setState(uint8_t state) {
+    DirPins::out() = (DirPins::out() & ~direction_mask) | directionBits(state);
+  };
+  static uint8_t getState(void) {
+    uint8_t pins = DirPins::out();
+    return ((pins & _BV(forward_bit)) ? FORWARD : IDLE) |
+           ((pins & _BV(backward_bit)) ? BACKWARD : IDLE);
+  };
+  static void addDirection(uint8_t state, uint8_t clear[GPIO_PORTS],
+                           uint8_t set[GPIO_PORTS]) {
+    clear[dir_port] |= direction_mask;
+    set[dir_port] |= directionBits(state);
+  };
+};
+
+// To be specialized by the board, for each motor.
+template<uint8_t motor> struct Wiring;
+
+// Invokes a static member of the wiring of a motor known at runtime.
+#define wiring_call(motor, call)                            \
+  do {                                                      \
+    switch (motor) {                                        \
+      case LEFT_REAR: Wiring<LEFT_REAR>::call; break;       \
+      case RIGHT_REAR: Wiring<RIGHT_REAR>::call; break;     \
+      case RIGHT_FRONT: Wiring<RIGHT_FRONT>::call; break;   \
+      case LEFT_FRONT: Wiring<LEFT_FRONT>::call; break;     \
+      default: break;                                       \
+    }                                                       \
+  } while (0)
+
+#define wiring_return(motor, call, fallback)                \
+  switch (motor) {                                          \
+    case LEFT_REAR: return Wiring<LEFT_REAR>::call;         \
+    case RIGHT_REAR: return Wiring<RIGHT_REAR>::call;       \
+    case RIGHT_FRONT: return Wiring<RIGHT_FRONT>::call;     \
+    case LEFT_FRONT: return Wiring<LEFT_FRONT>::call;       \
+    default: return fallback;                               \
+  }
+
+#endif
@@ -21,62 +21,245 @@
 
 // class TachoMotor
 
+// Called from ISR context: the period leaving the window is subtracted
+// from the running sum, before its slot is (possibly) overwritten.
 void
-TachoMotor::updateMotor(systime_t new_time) {
-  current = (current + 1) % TACHO_BUFFER_LEN;
-  timestamps[current] = new_time;
+TachoMotor::updateMotor(systime_t new_time, hirestime_t new_hires_time,
+                        hirestime_t timeout) {
+  hirestime_t hires_period = new_hires_time - last_hires_event;
+  if (restarted || (hires_period >= timeout)) {
+    restarted = false;
+  } else {
+    uint16_t period = (hires_period > TACHO_MAX_HIRES_PERIOD) ?
+                      TACHO_MAX_HIRES_PERIOD : hires_period;
+    uint8_t next = (current + 1) & TACHO_BUFFER_MASK;
+    period_sum -= periods[(next - _BV(window_shift)) & TACHO_BUFFER_MASK];
+    period_sum += period;
+    periods[next] = period;
+    current = next;
+  }
+  last_event = new_time;
+  last_hires_event = new_hires_time;
   counter++;
 }
 
 void
-TachoMotor::resetMotorPeriod(systime_t init_time) {
+TachoMotor::resetMotorPeriod(systime_t init_time,
+                             hirestime_t init_hires_time) {
   for (uint8_t i = 0; i < TACHO_BUFFER_LEN; i++)
-    timestamps[i] = init_time;
+    periods[i] = 0;
+  period_sum = 0;
+  restarted = true;
+  last_event = init_time;
+  last_hires_event = init_hires_time;
 }
 
 void
-TachoMotor::resetMotor(systime_t init_time) {
+TachoMotor::resetMotor(systime_t init_time, hirestime_t init_hires_time) {
   current = 0;
-  resetMotorPeriod(init_time);
+  resetMotorPeriod(init_time, init_hires_time);
   resetCounter();
 }
 
 systime_t
 TachoMotor::getLastEvent(void) {
-  return timestamps[current];
+  return last_event;
 }
 
-systime_t
-TachoMotor::getAvgPeriod(uint8_t periods) {
-  systime_t base = 0;
-  systime_t rest = 0;
-  for (unsigned short i = 0; i < periods; i++) {
-    systime_t delta =
-      timestamps[(current + TACHO_BUFFER_LEN - i) % periods] -
-      timestamps[(current + TACHO_BUFFER_LEN - i - 1) % periods];
-    base += delta / periods;
-    rest += delta % periods;
+// Selects an averaging window of (1 << shift) periods.
+// The running sum is rebuilt from the stored periods, which requires
+// excluding the tacho ISR for the duration of the loop.
+// Callable from any context, including the TWI ISR.
+void
+TachoMotor::setWindow(uint8_t shift) {
+  if (shift > TACHO_BUFFER_SHIFT)
+    shift = TACHO_BUFFER_SHIFT;
+  syssts_t sts = chSysGetStatusAndLockX();
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < _BV(shift); i++)
+    sum += periods[(current - i) & TACHO_BUFFER_MASK];
+  period_sum = sum;
+  window_shift = shift;
+  chSysRestoreStatusX(sts);
+}
+
+void
+TachoMotor::getSnapshot(TachoSnapshot &snapshot) {
+  snapshot.counter = counter;
+  snapshot.avg_period = getAvgPeriod();
+  snapshot.avg_hires_period = getAvgHiresPeriod();
+  snapshot.last_event = last_event;
+  snapshot.last_hires_event = last_hires_event;
+}
+
+// Alpha-beta-gamma observer of the counter, run once per control tick.
+// The state is kept in fixed point, with OBSERVER_STATE_SHIFT fractional
+// bits, in edges and control ticks: the position as its offset from the
+// counter, the speed in edges/tick and the acceleration in edges/tick^2.
+// A jump of the counter, such as a reset, restarts the observer.
+// The state is written with the ISR excluded, for the TWI readers.
+// The TWI ISR does not reset the state itself, since an update in
+// progress would overwrite it: it posts a request for the next update.
+void
+TachoMotor::resetObserver(uint32_t init_counter) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  observer_counter = init_counter;
+  observer_error = 0;
+  observer_speed = 0;
+  observer_acceleration = 0;
+  chSysRestoreStatusX(sts);
+}
+
+void
+TachoMotor::updateObserver(uint32_t new_counter,
+                           const uint16_t gains[OBSERVER_GAINS]) {
+  chSysLock();
+  bool reset = observer_reset;
+  observer_reset = false;
+  chSysUnlock();
+  uint32_t edges = new_counter - observer_counter;
+  if (reset || (edges > OBSERVER_MAX_EDGES)) {
+    resetObserver(new_counter);
+    return;
   }
-  return base + rest / periods;
+  int32_t residual = ((int32_t)edges << OBSERVER_STATE_SHIFT) -
+                     (observer_error + observer_speed +
+                      observer_acceleration / 2);
+  int32_t error = -residual +
+    ((residual >> OBSERVER_GAIN_SHIFT) * gains[OBSERVER_ALPHA]);
+  int32_t speed = observer_speed + observer_acceleration +
+    ((residual >> OBSERVER_GAIN_SHIFT) * gains[OBSERVER_BETA]);
+  int32_t acceleration = observer_acceleration +
+    ((residual >> (OBSERVER_GAIN_SHIFT - 1)) * gains[OBSERVER_GAMMA]);
+  chSysLock();
+  observer_counter = new_counter;
+  observer_error = error;
+  observer_speed = speed;
+  observer_acceleration = acceleration;
+  chSysUnlock();
+}
+
+void
+TachoMotor::getObserved(int32_t &speed, int32_t &acceleration) {
+  syssts_t sts = chSysGetStatusAndLockX();
+  speed = observer_speed;
+  acceleration = observer_acceleration;
+  chSysRestoreStatusX(sts);
 }
 
 // class TachoMotors
 
+#define compiler_barrier() __asm__ __volatile__("" ::: "memory")
+
 class TachoMotors *
 TachoMotors::tachomotors;
 
+uint16_t
+TachoMotors::observer_gains[OBSERVER_GAINS] = {
+  [OBSERVER_ALPHA] = 128,
+  [OBSERVER_BETA] = 32,
+  [OBSERVER_GAMMA] = 4,
+};
+
 TachoMotors::TachoMotors() {
     tachomotors = this;
+    hrtInit();
+    setTimeout(TACHO_DEFAULT_TIMEOUT_MS);
     resetMotors();
 };
 
 void TachoMotors::resetMotors() {
   systime_t init_time = chVTGetSystemTimeX();
+  hirestime_t init_hires_time = hrtGetTime();
   for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
-    motors[i].resetMotor(init_time);
+    motors[i].resetMotor(init_time, init_hires_time);
   }
 }
 
+// Callable from any context, including the TWI ISR. The observers
+// restart at their next update.
+void
+TachoMotors::resetObservers(void) {
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    motors[i].requestObserverReset();
+}
+
+// To be called once per control tick, from thread context.
+void
+TachoMotors::updateObservers(void) {
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++) {
+    TachoSnapshot snapshot;
+    getSnapshot(i, snapshot);
+    motors[i].updateObserver(snapshot.counter, observer_gains);
+  }
+}
+
+// Callable from any context, including the TWI ISR, so without 64 bits
+// math. Past ~4.19s the open period would overflow systime_t, so longer
+// timeouts are clamped; getTimeout() reports the one in effect. A null
+// timeout would report every motor as stopped and is ignored.
+void
+TachoMotors::setTimeout(uint16_t ms) {
+  if (ms == 0)
+    return;
+  if (ms > TACHO_MAX_TIMEOUT_MS)
+    ms = TACHO_MAX_TIMEOUT_MS;
+  syssts_t sts = chSysGetStatusAndLockX();
+  timeout_ms = ms;
+  timeout = ((uint32_t)ms * (HRT_FREQUENCY / 125)) / 8;
+  chSysRestoreStatusX(sts);
+}
+
+void
+TachoMotors::foldOpenPeriod(TachoSnapshot &snapshot, hirestime_t now) {
+  hirestime_t open_period = now - snapshot.last_hires_event;
+  if (open_period >= timeout) {
+    snapshot.avg_hires_period = 0;
+    snapshot.avg_period = 0;
+  } else if ((snapshot.avg_hires_period != 0) &&
+             (open_period > snapshot.avg_hires_period)) {
+    snapshot.avg_hires_period = (open_period > TACHO_MAX_HIRES_PERIOD) ?
+                                TACHO_MAX_HIRES_PERIOD : open_period;
+    snapshot.avg_period = HT2ST(open_period);
+  }
+}
+
+// The current time is read after the copy, within the same sequence,
+// so that it cannot precede the last edge.
+void
+TachoMotors::getSnapshot(uint8_t motor, TachoSnapshot &snapshot) {
+  uint8_t start;
+  hirestime_t now;
+  do {
+    start = sequence;
+    compiler_barrier();
+    motors[motor].getSnapshot(snapshot);
+    syssts_t sts = chSysGetStatusAndLockX();
+    now = hrtGetTimeX();
+    chSysRestoreStatusX(sts);
+    compiler_barrier();
+  } while (start != sequence);
+  foldOpenPeriod(snapshot, now);
+}
+
+void
+TachoMotors::getSnapshots(TachoSnapshot snapshots[MOTORS_NUMBER]) {
+  uint8_t start;
+  hirestime_t now;
+  do {
+    start = sequence;
+    compiler_barrier();
+    for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+      motors[i].getSnapshot(snapshots[i]);
+    syssts_t sts = chSysGetStatusAndLockX();
+    now = hrtGetTimeX();
+    chSysRestoreStatusX(sts);
+    compiler_barrier();
+  } while (start != sequence);
+  for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
+    foldOpenPeriod(snapshots[i], now);
+}
+
 #define isMotorActive(changes, motor) ((changes & _BV(motor)) ? true : false)
 
 #define blink() \
@@ -86,9 +269,12 @@ void tacho_cb(EXTDriver *extp, expchannel_t channel) {
   chSysLockFromISR();
   uint8_t changes = extp->pc_current_values[channel] ^
                     extp->pc_old_values[channel];
+  hirestime_t current_hires_time = hrtGetTimeX();
   systime_t current_time = chVTGetSystemTimeX();
   for (uint8_t i = 0; i < MOTORS_NUMBER; i++)
     if (isMotorActive(changes, i))
-      TachoMotors::tachomotors->motors[i].updateMotor(current_time);
+      TachoMotors::tachomotors->motors[i].updateMotor(
+        current_time, current_hires_time, TachoMotors::tachomotors->timeout);
+  TachoMotors::tachomotors->sequence++;
   chSysUnlockFromISR();
 }
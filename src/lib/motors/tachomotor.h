@@ -21,32 +21,113 @@
 #include "ch.h"
 #include "hal.h"
 #include "motors.h"
+#include "hirestime.h"
 
-#define TACHO_BUFFER_LEN 32
+#define TACHO_BUFFER_SHIFT 5
+#define TACHO_BUFFER_LEN (1 << TACHO_BUFFER_SHIFT)
+#define TACHO_BUFFER_MASK (TACHO_BUFFER_LEN - 1)
+#define TACHO_MAX_HIRES_PERIOD 0xFFFF
+#define TACHO_DEFAULT_TIMEOUT_MS 250
+#define TACHO_MAX_TIMEOUT_MS 4000
 
+// Gains of the observer, in 1/2^OBSERVER_GAIN_SHIFT.
+typedef enum {
+  OBSERVER_ALPHA = 0,
+  OBSERVER_BETA,
+  OBSERVER_GAMMA,
+  OBSERVER_GAINS,
+} ObserverGains;
+
+typedef enum {
+  OBSERVER_GAIN_SHIFT = 8,
+  OBSERVER_STATE_SHIFT = 16,
+  OBSERVER_MAX_GAIN = 2 << OBSERVER_GAIN_SHIFT,
+  OBSERVER_MAX_EDGES = 0x3FF,
+} ObserverResolution;
+
+// The counter wraps at 32 bits: distances are the unsigned difference
+// of two readings, valid as long as they are less than 2^32 edges apart.
+typedef struct {
+  uint32_t counter;
+  systime_t avg_period;
+  uint16_t avg_hires_period;
+  systime_t last_event;
+  hirestime_t last_hires_event;
+} TachoSnapshot;
+
+// Periods are stored in high resolution ticks, saturated to 16 bits.
+// The average is calculated over a power-of-two window of periods,
+// so that it boils down to a shift of the running sum.
+// The first interval after a reset, or after a gap longer than the
+// timeout, is not a period of the running motor and is not stored.
 class TachoMotor {
   protected:
-    systime_t timestamps[TACHO_BUFFER_LEN];
-    uint16_t counter;
+    uint16_t periods[TACHO_BUFFER_LEN];
+    systime_t last_event;
+    hirestime_t last_hires_event;
+    uint32_t period_sum;
+    uint32_t counter;
     uint8_t current;
+    uint8_t window_shift;
+    bool restarted;
+    volatile bool observer_reset;
+    uint32_t observer_counter;
+    int32_t observer_error;
+    int32_t observer_speed;
+    int32_t observer_acceleration;
   public:
-    TachoMotor(){resetMotor(chVTGetSystemTimeX());};
-    void resetMotorPeriod(systime_t init_time);
-    void resetMotor(systime_t init_time);
-    void updateMotor(systime_t new_time);
+    TachoMotor(): window_shift(TACHO_BUFFER_SHIFT) {
+      resetMotor(chVTGetSystemTimeX(), hrtGetTime());
+    };
+    void resetMotorPeriod(systime_t init_time, hirestime_t init_hires_time);
+    void resetMotor(systime_t init_time, hirestime_t init_hires_time);
+    void updateMotor(systime_t new_time, hirestime_t new_hires_time,
+                     hirestime_t timeout);
     systime_t getLastEvent(void);
-    systime_t getAvgPeriod(uint8_t periods=(TACHO_BUFFER_LEN - 1));
-    uint16_t getCounter(void) {return counter;};
+    hirestime_t getLastHiresEvent(void) {return last_hires_event;};
+    uint16_t getAvgHiresPeriod(void) {
+      return (uint16_t)(period_sum >> window_shift);
+    };
+    systime_t getAvgPeriod(void) {
+      return HT2ST(period_sum >> window_shift);
+    };
+    void setWindow(uint8_t shift);
+    uint8_t getWindow(void) {return window_shift;};
+    uint32_t getCounter(void) {return counter;};
     void resetCounter(void) {counter = 0x0000;};
+    void getSnapshot(TachoSnapshot &snapshot);
+    void resetObserver(uint32_t init_counter);
+    void requestObserverReset(void) {observer_reset = true;};
+    void updateObserver(uint32_t new_counter,
+                        const uint16_t gains[OBSERVER_GAINS]);
+    void getObserved(int32_t &speed, int32_t &acceleration);
 };
 
 extern "C" void tacho_cb(EXTDriver *extp, expchannel_t channel);
 
+// Readers from thread context must not access the motors directly,
+// since the ISR can update them halfway through a multi-byte read.
+// Snapshots are taken without locking: the copy is simply repeated
+// if the sequence number was bumped by tacho_cb() in the meanwhile.
+// The time elapsed since the last edge is a lower bound of the current
+// period, so it replaces the average when longer; past the timeout the
+// motor is reported as stopped, with null periods.
 class TachoMotors {
   protected:
+    volatile uint8_t sequence;
+    hirestime_t timeout;
+    uint16_t timeout_ms;
+    void foldOpenPeriod(TachoSnapshot &snapshot, hirestime_t now);
   public:
+    static uint16_t observer_gains[OBSERVER_GAINS];
     TachoMotor motors[MOTORS_NUMBER];
     void resetMotors();
+    void getSnapshot(uint8_t motor, TachoSnapshot &snapshot);
+    void getSnapshots(TachoSnapshot snapshots[MOTORS_NUMBER]);
+    void setTimeout(uint16_t ms);
+    uint16_t getTimeout(void) {return timeout_ms;};
+    void resetObservers(void);
+    void updateObservers(void);
     static class TachoMotors *tachomotors;
     TachoMotors();
     friend void tacho_cb(EXTDriver *extp, expchannel_t channel);
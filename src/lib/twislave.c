@@ -83,18 +83,16 @@ ISR(TWI_vect) {
     case TWI_SRX_ADR_DATA_ACK:    // Got Data
       switch (status) {
         case WAITING_FOR_COMMAND: {
-          register uint8_t i;
-          for (i = 0; i < twi_bf->items_nr; i++) {
-            active_buffer = twi_bf->items[i];
-            register uint8_t parm = get_parm_field(TWDR);
-            if ((active_buffer->parm_low <= parm) &&
-                (active_buffer->parm_high >= parm)){
-              active_buffer->data[0] = TWDR;
-              active_buffer->data_counter = 1;
-              status = WAITING_FOR_RESTART_OR_WRITE;
-              TWCR = TWCR_SEND_ACK;
-              return;
-            }
+          register uint8_t command = TWDR;
+          register TWI_Buffer *buffer =
+            twi_parm_table[get_parm_field(command)];
+          if (buffer) {
+            active_buffer = buffer;
+            active_buffer->data[0] = command;
+            active_buffer->data_counter = 1;
+            status = WAITING_FOR_RESTART_OR_WRITE;
+            TWCR = TWCR_SEND_ACK;
+            return;
           }
           status = WAITING_FOR_COMMAND;
           TWCR = TWCR_SEND_NACK;
@@ -35,6 +35,8 @@
 #define set_parm_field(reg, parm) (((parm) << 4) | reset_parm_field(reg))
 #define get_parm_field(reg) ((reg) >> 4)
 
+#define TWI_PARMS_NUMBER ((PARM_MASK >> 4) + 1)
+
 #define ITEM_MASK (_BV(3) | _BV(2) | _BV(1) | _BV(0))
 #define reset_item_field(reg) ((reg) & ~ITEM_MASK)
 #define set_item_field(reg, item) ((item ) | reset_item_field(reg))
@@ -71,6 +73,8 @@ typedef struct {
 // Not for direct use.
 // Creates the descriptor for the ranged TWI handler
 #define DECLARE_TWI_HANDLER(name) \
+  _Static_assert(TWI_##name##_END_RANGE < TWI_PARMS_NUMBER, \
+                 "TWI " #name " commands exceed the parameter field"); \
   extern uint8_t twi_##name##_handler(uint8_t mode); \
   twi_buf_type(name) \
   TWI_Buffer_##name twi_##name = { \
@@ -94,7 +98,15 @@ typedef struct {
 #define addr_to_twi_buf(name) \
   ((TWI_Buffer*)(&(twi_##name)))
 
+// Not for direct use.
+// Maps the range of parameters of a handler to its buffer.
+#define twi_parm_range(name) \
+  [TWI_##name##_START_RANGE ... TWI_##name##_END_RANGE] = \
+    addr_to_twi_buf(name)
+
 // To be called from a centralized place, with all the TWI handlers.
+// Besides the list of buffers, it builds the table used by the ISR to
+// find the handler of a command with a single indexed load.
 #define DECLARE_TWI_HANDLERS(...) \
   ITERATE_SEMICOLON(DECLARE_TWI_HANDLER, __VA_ARGS__) \
   ITERATE_SEMICOLON(extern_twi_buf, __VA_ARGS__)      \
@@ -111,7 +123,9 @@ typedef struct {
       ITERATE_COMMA(addr_to_twi_buf, __VA_ARGS__)  \
     }, \
   }; \
-  TWI_Buffers *twi_bf = (TWI_Buffers*)&twi_buffers;
+  TWI_Buffer *twi_parm_table[TWI_PARMS_NUMBER] = { \
+    ITERATE_COMMA(twi_parm_range, __VA_ARGS__) \
+  };
 
 #define DECLARE_EXTERN_TWI_HANDLERS(...) \
   ITERATE_SEMICOLON(twi_buf_type, __VA_ARGS__)      \
@@ -132,7 +146,7 @@ typedef struct {
     TWI_##name##_END_RANGE = TWI_##name##_DUMMY_END - 1, \
   }TWI_##name##_COMMANDS
 
-extern TWI_Buffers *twi_bf;
+extern TWI_Buffer *twi_parm_table[TWI_PARMS_NUMBER];
 extern void twi_get_bf_addr(void);
 extern void *tester(void);
 void twi_initialise(const uint8_t slave_address, const uint8_t general);
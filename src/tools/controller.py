@@ -61,6 +61,14 @@ class Communicator:
         return self.serialRunCommandsSequence(sequence)
 
 
+# MotorTelemetry, as returned for each motor by the TELEMETRY register:
+# pwm, state, tacho count, average period, target period, observed
+# speed (edges/s) and observed acceleration (edges/s^2).
+TELEMETRY_FORMAT = '<BBIHHhh'
+TELEMETRY_SIZE = struct.calcsize(TELEMETRY_FORMAT)
+MOTORS_NUMBER = 4
+
+
 class Controller:
     def __init__(self):
         print("")
@@ -185,9 +193,11 @@ class UI:
             "GetDirection":   {"value": "2", "bytes_read": 1},
             "GetCalibPeriod": {"value": "4", "bytes_read": 2},
             "GetAvgPeriod":   {"value": "5", "bytes_read": 2},
-            "GetCount":       {"value": "6", "bytes_read": 2},
+            "GetCount":       {"value": "6", "bytes_read": 4},
             "GetM":           {"value": "7", "bytes_read": 4},
             "GetQ":           {"value": "8", "bytes_read": 4},
+            "GetTelemetry":   {"value": "a",
+                               "bytes_read": TELEMETRY_SIZE * MOTORS_NUMBER},
         }
         write_commands = {
             "SetIntensity":     {"value": "1", "bytes_read": 0},
@@ -246,23 +256,42 @@ class UI:
             pwm=str(self.motor["AllRawMotors"]["pwm"].get()),
         )
 
+    def I2CRawMotorsApplyBlock(self, settings):
+        # Indexed as the Motors enum in the firmware.
+        motors = ["LeftRearRawMotor", "RightRearRawMotor",
+                  "RightFrontRawMotor", "LeftFrontRawMotor"]
+        mask = 0
+        data = []
+        for index, motor in enumerate(motors):
+            status, pwm = settings.get(motor, ("idle", "0"))
+            if motor in settings:
+                mask |= 1 << index
+            data += [pwm, "0x" + self.status_dict[status]]
+        return self.I2CWriteCommand(
+            address=self.i2cmotorsaddress.get(),
+            command="0xb0",
+            data=[hex(mask)] + data,
+        )
+
     def I2CApplySidesRawMotors(self):
+        settings = {}
         for side in ["Left", "Right"]:
             for x in ["Front", "Rear"]:
-                self.I2CRawMotorsApply(
-                    motor=side + x + "RawMotor",
-                    status=self.motor[side + "Side" + "RawMotors"]["status"].get(),
-                    pwm=str(self.motor[side + "Side" + "RawMotors"]["pwm"].get()),
+                settings[side + x + "RawMotor"] = (
+                    self.motor[side + "Side" + "RawMotors"]["status"].get(),
+                    str(self.motor[side + "Side" + "RawMotors"]["pwm"].get()),
                 )
+        self.I2CRawMotorsApplyBlock(settings)
 
     def I2CApplyIndividualsRawMotors(self):
+        settings = {}
         for side in ["Left", "Right"]:
             for x in ["Front", "Rear"]:
-                self.I2CRawMotorsApply(
-                    motor=side + x + "RawMotor",
-                    status=self.motor[side + x + "RawMotor"]["status"].get(),
-                    pwm=str(self.motor[side + x + "RawMotor"]["pwm"].get()),
+                settings[side + x + "RawMotor"] = (
+                    self.motor[side + x + "RawMotor"]["status"].get(),
+                    str(self.motor[side + x + "RawMotor"]["pwm"].get()),
                 )
+        self.I2CRawMotorsApplyBlock(settings)
 
     def I2CMotorsApply(self):
         active_table = {
@@ -322,9 +351,36 @@ class UI:
             for sideFR in ["Front", "Rear"]:
                 self.I2CMotorAcquireTacho(sideLR=sideLR, sideFR=sideFR)
 
+    def I2CMotorsAcquireTelemetry(self):
+        # Indexed as the Motors enum in the firmware.
+        motors = [("Left", "Rear"), ("Right", "Rear"),
+                  ("Right", "Front"), ("Left", "Front")]
+        success, retvals = self.I2CApplyMotorsCommand(command="GetTelemetry")
+        if not success or len(retvals) != TELEMETRY_SIZE * len(motors):
+            return False
+        data = bytes([int(retv, 16) for retv in retvals])
+        for index, (sideLR, sideFR) in enumerate(motors):
+            pwm, state, count, period, target, speed, acceleration = \
+                struct.unpack_from(TELEMETRY_FORMAT, data,
+                                   TELEMETRY_SIZE * index)
+            raw = sideLR + sideFR + "RawMotor"
+            tacho = sideLR + sideFR + "TachoMotor"
+            self.builder.get_variable(raw + "IntensityInput").set(hex(pwm))
+            self.builder.get_variable(raw + "DirectionInput").set(
+                list(self.status_dict)
+                    [list(self.status_dict.values()).index(str(state))])
+            self.builder.get_variable(tacho + "CountInput").set(hex(count))
+            self.builder.get_variable(tacho + "AvgPeriodInput").set(
+                hex(period))
+            self.builder.get_variable(tacho + "SpeedInput").set(str(speed))
+            self.builder.get_variable(tacho + "AccelerationInput").set(
+                str(acceleration))
+        return True
+
     def I2CMotorsAcquire(self):
-        self.I2CMotorsAcquireRaw()
-        self.I2CMotorsAcquireTacho()
+        if not self.I2CMotorsAcquireTelemetry():
+            self.I2CMotorsAcquireRaw()
+            self.I2CMotorsAcquireTacho()
 
     def I2CMotorsReset(self):
         self.I2CRawMotorsApply(